@@ -0,0 +1,459 @@
+/* Name: bench.c
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Runs the firmware core (src/core.c) natively. It stands in for main.c and
+ * the USB driver: the ADC functions convert a waveform, the main loop calls
+ * adcPoll() and reportPoll() once per conversion time (or per Timer0 trigger
+ * with ADC_TRIGGER), and the host fetches the interrupt report every
+ * USB_CFG_INTR_POLL_INTERVAL ms.
+ *
+ * Without arguments a fixed set of synthetic scenarios is run and their
+ * results printed to stdout, which "make check" compares against
+ * expected.txt. The throughput of the core goes to stderr, as it depends on
+ * the machine. With -f, a recorded stream of conversions is replayed instead
+ * and every report is printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "core.h"
+
+#define F_CPU_HZ        16500000.0
+#define CONVERSION_US   (13 * 128 * 1e6 / F_CPU_HZ)  /* 13 ADC clocks at clk/128 */
+#if ADC_TRIGGER
+#define LOOP_US         (1e6 / ADC_SAMPLE_RATE)
+#else
+#define LOOP_US         CONVERSION_US
+#endif
+#define TEMPERATURE_LSB 300 /* sensor reading at 25 C */
+
+/* ---------------------------- USB driver stand-in ------------------------ */
+
+usbMsgPtr_t     usbMsgPtr;
+usbTxStatus_t   usbTxStatus1, usbTxStatus3;
+
+static uchar    sentReport[8];
+static uchar    sentLength;
+
+void usbSetInterrupt(uchar *data, uchar len)
+{
+    memcpy(sentReport, data, len);
+    sentLength = len;
+    usbTxLen1 = len;                /* busy until the host polls */
+}
+
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3
+void usbSetInterrupt3(uchar *data, uchar len)
+{
+    /* events are not measured, the endpoint stays free */
+}
+#endif
+
+/* ---------------------------- platform stand-in -------------------------- */
+
+static double   nowUs;              /* simulated time */
+
+unsigned int clockStamp(void)
+{
+    return (unsigned int)(nowUs / 1000);
+}
+
+#if POLL_LOCK || CAPTURE
+unsigned int clockTicks(void)
+{
+    return (unsigned int)(nowUs * F_CPU_HZ / 64e6);
+}
+#endif
+
+typedef double (*waveform_t)(double seconds, int channel);
+
+static waveform_t   adcWave;        /* NULL for throughput(): pseudo random */
+static uchar        adcInput;       /* as selected by adcSelect() */
+static unsigned long adcConversions;/* including discarded ones */
+static unsigned long adcTemperatures;
+
+/* Convert the selected input now. Channel 1 of a waveform is PB4. */
+static unsigned adcConvert(uchar input)
+{
+    double      seconds = nowUs / 1e6, volts;
+
+    adcConversions++;
+    if(!adcWave)
+        return (adcConversions * 7919) & 0x3ff;
+    if(input == ADC_TEMPERATURE) {
+        adcTemperatures++;
+        return TEMPERATURE_LSB;
+    }
+#if ADC_DIFFERENTIAL
+    volts = (adcWave(seconds, 1) - adcWave(seconds, 0)) * ADC_DIFF_GAIN;   /* ADC2 - ADC3 */
+#if ADC_DIFF_BIPOLAR
+    return volts <= -5 ? 0x200 : volts >= 5 ? 0x1ff : (int)floor(volts / 5.0 * 512) & 0x3ff;
+#endif
+#else
+    volts = adcWave(seconds, input);
+#endif
+    return volts <= 0 ? 0 : volts >= 5 ? 1023 : (unsigned)(volts / 5.0 * 1024);
+}
+
+void adcSelect(uchar input)
+{
+    adcInput = input;
+}
+
+#if !ADC_TRIGGER
+static uchar        adcRunning;     /* until the next main loop iteration */
+static unsigned     adcData;        /* the ADC data register */
+
+void adcStart(void)
+{
+    adcData = adcConvert(adcInput);
+    adcRunning = 1;
+}
+
+uchar adcBusy(void)
+{
+    return adcRunning;
+}
+
+unsigned int adcRead(void)
+{
+    return adcData;
+}
+#endif
+
+#if CAPTURE
+static uchar        adcBurstInput;
+
+void adcBurstStart(uchar input)
+{
+    adcBurstInput = input;
+}
+
+unsigned int adcBurstRead(void)
+{
+    nowUs += CONVERSION_US;         /* the main loop waits for it */
+    return adcConvert(adcBurstInput);
+}
+
+void adcBurstStop(void)
+{
+}
+#endif
+
+/* One main loop iteration, LOOP_US after the previous one. The conversion
+ * started in the previous one has completed, or Timer0 triggered one.
+ */
+static void loop(void)
+{
+    unsigned int now = (unsigned int)(nowUs / 1000);
+
+#if ADC_TRIGGER
+    adcQueue(adcConvert(adcInput));
+#else
+    adcRunning = 0;
+#endif
+    adcPoll(now);
+    reportPoll(now);
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct result {
+    unsigned long   reports;
+    unsigned        before;         /* last report before the step at 1 s */
+    double          firstCross;     /* s, first report past the midpoint after it */
+    double          last;           /* last reported value */
+    double          sum, sumSquares;/* of reports after settleTime */
+    unsigned long   settled;
+    unsigned        minimum, maximum;
+    unsigned long   conversions;    /* including discarded ones */
+    unsigned long   temperatures;   /* of them, of the temperature sensor */
+} result_t;
+
+static unsigned reportValue(const uchar *report)
+{
+    /* the newest sample is in the last slot, see report.h */
+    unsigned long   bits = 0;
+    int             i;
+
+    for(i = (REPORT_NEWEST_BIT + REPORT_AXIS_BITS - 1) / 8; i >= REPORT_NEWEST_BIT / 8; i--)
+        bits = bits << 8 | report[i];
+    return (bits >> REPORT_NEWEST_BIT % 8 & REPORT_AXIS_MAX) << (16 - REPORT_AXIS_BITS);
+}
+
+static void hostPoll(double seconds, result_t *result, double settleTime, FILE *trace)
+{
+    unsigned value;
+
+    if(usbInterruptIsReady())
+        return;                     /* nothing sent since the last poll */
+    usbTxLen1 = USBPID_NAK;
+    if(REPORT_IDS && sentReport[0] != REPORT_ID_JOYSTICK)
+        return;                     /* a keyboard report */
+    value = reportValue(sentReport);
+    result->reports++;
+    result->last = value;
+    if(seconds <= 1)
+        result->before = value;
+    else if(!result->firstCross && (value > 0x8000) != (result->before > 0x8000))
+        result->firstCross = seconds;
+    if(seconds >= settleTime) {
+        result->sum += value;
+        result->sumSquares += (double)value * value;
+        if(!result->settled || value < result->minimum)
+            result->minimum = value;
+        if(!result->settled || value > result->maximum)
+            result->maximum = value;
+        result->settled++;
+    }
+    if(trace)
+        fprintf(trace, "%10.3f %5u\n", seconds * 1000, value);
+}
+
+static void run(waveform_t wave, double seconds, double settleTime, result_t *result)
+{
+    double  nextPoll = USB_CFG_INTR_POLL_INTERVAL * 1000.0;
+
+    memset(result, 0, sizeof(*result));
+    coreInit();
+    calibrationDefaults();
+    calibrationApply();
+    usbTxLen1 = USBPID_NAK;
+    adcWave = wave;
+    adcConversions = 0;
+    adcTemperatures = 0;
+#if !ADC_TRIGGER
+    adcStart();                     /* as adcInit() does */
+#endif
+    for(nowUs = 0; nowUs < seconds * 1e6; nowUs += LOOP_US) {
+        loop();
+        if(nowUs >= nextPoll) {
+            hostPoll(nowUs / 1e6, result, settleTime, NULL);
+            nextPoll += USB_CFG_INTR_POLL_INTERVAL * 1000.0;
+        }
+    }
+    result->conversions = adcConversions;
+    result->temperatures = adcTemperatures;
+}
+
+/* --------------------------------- waveforms ------------------------------ */
+
+/* Deterministic noise, the same on every machine: xorshift32 */
+static unsigned long noiseState = 1;
+
+static double noise(void)
+{
+    noiseState ^= (noiseState << 13) & 0xffffffffUL;
+    noiseState ^= noiseState >> 17;
+    noiseState ^= (noiseState << 5) & 0xffffffffUL;
+    return (double)(noiseState & 0xffff) / 0x10000 - 0.5;
+}
+
+/* PB4 (channel 1) carries the signal, PB3 (channel 0) its complement */
+static double complement(double volts, int channel)
+{
+    return channel ? volts : 5 - volts;
+}
+
+static double waveStep(double seconds, int channel)
+{
+    return complement(seconds < 1 ? 1.0 : 4.0, channel);
+}
+
+static double waveNoise(double seconds, int channel)
+{
+    return complement(2.5 + 4 * 5.0 / 1024 * noise(), channel);   /* +-2 LSB */
+}
+
+static double waveSpikes(double seconds, int channel)
+{
+    long conversion = seconds * 1e6 / CONVERSION_US;
+
+    return complement(conversion % 97 == 0 ? 5.0 : 2.5, channel);
+}
+
+static double waveRamp(double seconds, int channel)
+{
+    return complement(0.5 + 4.0 * seconds / 2, channel);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void scenarios(void)
+{
+    result_t    r;
+    double      mean, rms;
+
+    printf("config: oversample %d, median %d, ema shift %d, deadband %d, batch %d, curve %d, rest %d ms\n",
+           ADC_OVERSAMPLE, FILTER_MEDIAN, FILTER_EMA_SHIFT, REPORT_DEADBAND, REPORT_BATCH,
+           REPORT_CURVE, MOTION_REST_MS);
+
+    run(waveStep, 2, 1.5, &r);
+    printf("step 1 V -> 4 V at 1 s: midpoint reported after %.1f ms, settles at %.0f\n",
+           (r.firstCross - 1) * 1000, r.last);
+
+    run(waveNoise, 2, 0.5, &r);
+    mean = r.sum / r.settled;
+    rms = sqrt(r.sumSquares / r.settled - mean * mean);
+    printf("noise +-2 LSB at 2.5 V: mean %.0f, rms %.1f, range %u, %lu reports in 2 s\n",
+           mean, rms, r.maximum - r.minimum, r.reports);
+    printf("  %lu conversions, %lu of the temperature sensor\n", r.conversions, r.temperatures);
+
+    run(waveSpikes, 2, 0.5, &r);
+    printf("spikes to 5 V every 97 conversions: range %u, max %u\n",
+           r.maximum - r.minimum, r.maximum);
+
+    run(waveRamp, 2, 0, &r);
+    printf("ramp 0.5 V -> 4.5 V in 2 s: %lu reports, last %.0f\n", r.reports, r.last);
+    printf("  %lu conversions\n", r.conversions);
+}
+
+/* Send a control request as the 8 byte setup packet */
+static uchar setup(uchar type, uchar request, unsigned value, unsigned length)
+{
+    uchar packet[8] = { type, request, value & 0xff, value >> 8, 0, 0, length & 0xff, length >> 8 };
+
+    return usbFunctionSetup(packet);
+}
+
+static void requests(void)
+{
+    calibration_t   record;
+    uchar           *p = (uchar *)&record;
+    uchar           i, status = 0;
+
+    coreInit();
+    calibrationDefaults();
+    calibrationApply();
+    printf("GET_REPORT input: %d bytes\n", setup(USBRQ_TYPE_CLASS | USBRQ_DIR_DEVICE_TO_HOST,
+           USBRQ_HID_GET_REPORT, 0x100 | (REPORT_IDS ? REPORT_ID_JOYSTICK : 0), REPORT_SIZE));
+
+    printf("GET_CALIBRATION: %s\n",
+           setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_DEVICE_TO_HOST, RQ_GET_CALIBRATION, 0,
+                 sizeof(calibration_t)) == sizeof(calibration_t) ? "whole record" : "wrong length");
+    memcpy(&record, usbMsgPtr, sizeof(record));
+
+    /* The record is sent as laid out on the host, whose ints are wider */
+    record.travelMin = 0x4000;
+    record.travelMax = 0xc000;
+    setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE, RQ_SET_CALIBRATION, 0, sizeof(record));
+    for(i = 0; i < sizeof(record); i += 8)
+        status = usbFunctionWrite(p + i, sizeof(record) - i < 8 ? sizeof(record) - i : 8);
+    printf("SET_CALIBRATION with a bad checksum: %s\n", status == 0xff ? "stalled" : "accepted");
+
+    record.checksum = 0xff;
+    for(i = 0; i < sizeof(record); i++)
+        if(p + i != &record.checksum)
+            record.checksum -= p[i];
+    setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE, RQ_SET_CALIBRATION, 0, sizeof(record) - 1);
+    status = usbFunctionWrite(p, 8);
+    printf("SET_CALIBRATION of %d bytes: %s\n", (int)sizeof(record) - 1,
+           status == 0xff ? "stalled" : "accepted");
+
+    setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE, RQ_SET_CALIBRATION, 0, sizeof(record));
+    for(i = 0; i < sizeof(record); i += 8)
+        status = usbFunctionWrite(p + i, sizeof(record) - i < 8 ? sizeof(record) - i : 8);
+    printf("SET_CALIBRATION with travel 0x4000..0xc000: %s, %s to save\n",
+           status == 1 ? "accepted" : "stalled",
+           calibrationUnsaved == sizeof(record) ? "whole record" : "wrong length");
+
+#if CAPTURE
+    printf("CAPTURE_START of input %d: %s\n", ADC_CHANNELS,
+           setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE, RQ_CAPTURE_START, ADC_CHANNELS, 0)
+           == (uchar)USB_NO_MSG ? "refused" : "accepted");
+    adcWave = waveRamp;
+    nowUs = 1e6;
+    setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_HOST_TO_DEVICE, RQ_CAPTURE_START, ADC_CHANNELS - 1, 0);
+    adcPoll((unsigned int)(nowUs / 1000));
+    setup(USBRQ_TYPE_VENDOR | USBRQ_DIR_DEVICE_TO_HOST, RQ_CAPTURE_READ, 0, sizeof(capture_t));
+    printf("CAPTURE of input %d on a ramp: %u samples in %u ticks, %u .. %u\n",
+           ADC_CHANNELS - 1, ((capture_t *)usbMsgPtr)->count, ((capture_t *)usbMsgPtr)->ticks,
+           ((capture_t *)usbMsgPtr)->samples[0],
+           ((capture_t *)usbMsgPtr)->samples[CAPTURE_SAMPLES - 1]);
+#endif
+}
+
+/* Throughput of the whole path from conversion to report, on this machine */
+static void throughput(void)
+{
+    struct timespec start, end;
+    unsigned long   i, count = 20000000;
+    double          ns;
+
+    coreInit();
+    calibrationDefaults();
+    calibrationApply();
+    usbTxLen1 = USBPID_NAK;
+    adcWave = NULL;
+    adcConversions = 0;
+#if !ADC_TRIGGER
+    adcStart();
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++) {
+        nowUs = i * LOOP_US;
+        loop();
+        usbTxLen1 = USBPID_NAK;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / adcConversions;
+    fprintf(stderr, "throughput: %.1f ns per conversion, %.2f M conversions/s\n", ns, 1e3 / ns);
+}
+
+/* Replay "channel value" lines, one per collected conversion, spaced like
+ * the real ADC, and print every report as "ms value". The recording already
+ * went through the conversion sequence, so it is fed to adcCollect().
+ */
+static int replay(const char *path)
+{
+    FILE        *file = fopen(path, "r");
+    char        line[128];
+    result_t    r;
+    double      nextPoll = USB_CFG_INTR_POLL_INTERVAL * 1000.0;
+
+    if(!file) {
+        perror(path);
+        return 1;
+    }
+    memset(&r, 0, sizeof(r));
+    coreInit();
+    calibrationDefaults();
+    calibrationApply();
+    usbTxLen1 = USBPID_NAK;
+    nowUs = 0;
+    while(fgets(line, sizeof(line), file)) {
+        int channel;
+        unsigned value;
+
+        if(line[0] == '#' || sscanf(line, "%d %u", &channel, &value) != 2)
+            continue;
+        adcCollect(channel % ADC_CHANNELS, value & 0x3ff);
+        reportPoll((unsigned int)(nowUs / 1000));
+        nowUs += CONVERSION_US;
+        if(nowUs >= nextPoll) {
+            hostPoll(nowUs / 1e6, &r, 0, stdout);
+            nextPoll += USB_CFG_INTR_POLL_INTERVAL * 1000.0;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 3 && !strcmp(argv[1], "-f"))
+        return replay(argv[2]);
+    if(argc != 1) {
+        fprintf(stderr, "usage: %s [-f conversions.txt]\n", argv[0]);
+        return 2;
+    }
+    scenarios();
+    requests();
+    throughput();
+    return 0;
+}
@@ -0,0 +1,3 @@
+/* Host stand-in for avr-libc, pulled in by usbdrv.h. core.c does no register
+ * access, so nothing needs to be defined here.
+ */
@@ -0,0 +1,9 @@
+/* Host stand-in for avr-libc: flash is ordinary memory. */
+#ifndef __pgmspace_h_included__
+#define __pgmspace_h_included__
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#define pgm_read_word(addr) (*(const unsigned int *)(addr))
+
+#endif /* __pgmspace_h_included__ */
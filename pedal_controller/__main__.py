@@ -1,7 +1,10 @@
 from struct import unpack
 import os
+import sys
 import keyboard
 
+from .report import ReportDecoder, read_descriptor
+
 
 def main():
     dev_path = get_dev_path()
@@ -15,11 +18,12 @@ def main():
 
 
 def event_loop(dev_path):
-    steps = 9 / 1024
+    steps = 9 / 65536
     last_step = 4
     pause = False
-    with open(dev_path, "rb") as handle:
-        for value in iter_values(handle):
+    decoder = ReportDecoder(read_descriptor(dev_path))
+    with open(dev_path, "rb", buffering=0) as handle:
+        for value in iter_values(handle, decoder):
             step = int(value * steps)
             if step != last_step:
                 diff = step - last_step
@@ -32,11 +36,18 @@ def event_loop(dev_path):
                 last_step = step
 
 
-def iter_values(handle):
+def iter_values(handle, decoder):
+    last_sequence = None
     try:
         while True:
-            word = unpack("h", handle.read(2))[0]
-            yield word
+            report = decoder.decode(handle.read(64))
+            if report.sequence is not None:
+                if last_sequence is not None:
+                    lost = (report.sequence - last_sequence - 1) & 0xFF
+                    if lost:
+                        print(f"lost {lost} reports", file=sys.stderr)
+                last_sequence = report.sequence
+            yield from report.samples
     except OSError:
         pass
 
@@ -61,7 +72,7 @@ def is_device(path):
 def read():
     with open("/dev/hidraw0", "rb") as handle:
         while True:
-            word = unpack("h", handle.read(2))
+            word = unpack("<H", handle.read(2))
             print(f"{word}")
 
 
@@ -0,0 +1,53 @@
+"""Dump burst captures of firmware built with CAPTURE.
+
+Each capture converts one input back to back into the device's RAM, at the
+full ADC rate and without USB reporting in between, and is then read with a
+vendor control request, see capture_t in src/core.h. Every line of output
+holds the time in microseconds from the first conversion and the raw 10 bit
+value. Captures are separated by a blank line; they are not contiguous.
+"""
+
+import argparse
+import struct
+import sys
+
+from .usbfs import Device
+
+RQ_CAPTURE_START = 3
+RQ_CAPTURE_READ = 4
+HEADER = struct.Struct("<HBB")
+TICK = 64 / 16.5e6  # Timer1 tick in seconds
+MAX_LENGTH = 254
+
+
+def capture(device, channel):
+    device.control_out(RQ_CAPTURE_START, channel)
+    data = device.control_in(RQ_CAPTURE_READ, MAX_LENGTH)
+    if len(data) < HEADER.size:
+        raise SystemExit("Firmware was built without CAPTURE")
+    ticks, _, count = HEADER.unpack_from(data)
+    if not count:
+        raise SystemExit("Capture did not run")
+    samples = struct.unpack_from(f"<{count}H", data, HEADER.size)
+    period = ticks * TICK / (count - 1)
+    return [(i * period, value) for i, value in enumerate(samples)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-c", "--channel", type=int, choices=(0, 1), default=1,
+                        help="input to capture, 0 for PB3 or 1 for PB4 (default)")
+    parser.add_argument("-n", "--count", type=int, default=1, help="number of captures")
+    parser.add_argument("-o", "--output", help="file to write, default stdout")
+    args = parser.parse_args()
+    output = open(args.output, "w") if args.output else sys.stdout
+    with Device() as device, output:
+        for index in range(args.count):
+            if index:
+                print(file=output)
+            for seconds, value in capture(device, args.channel):
+                print(f"{seconds * 1e6:10.1f} {value:4d}", file=output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+"""Show the performance counters of firmware built with DIAGNOSTICS.
+
+The counters are read from HID feature report 2 through the hidraw
+HIDIOCGFEATURE ioctl, see diagnostics_t in src/core.h for the layout.
+"""
+
+import argparse
+import fcntl
+import struct
+import time
+
+from .__main__ import get_dev_path
+
+REPORT_ID = 2
+LAYOUT = struct.Struct("<BIBHII")
+FIELDS = (
+    "loops per second",
+    "watchdog resets",
+    "samples dropped",
+    "max loop cycles",
+    "ADC conversions",
+)
+
+
+def hidiocgfeature(length):
+    """_IOC(_IOC_WRITE | _IOC_READ, 'H', 0x07, length) from linux/hidraw.h"""
+    return (3 << 30) | (length << 16) | (ord("H") << 8) | 0x07
+
+
+def read_counters(handle):
+    buffer = bytearray(LAYOUT.size)
+    buffer[0] = REPORT_ID
+    fcntl.ioctl(handle, hidiocgfeature(len(buffer)), buffer)
+    report_id, *values = LAYOUT.unpack(buffer)
+    if report_id != REPORT_ID:
+        raise SystemExit("Firmware was built without DIAGNOSTICS")
+    return dict(zip(FIELDS, values))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-i", "--interval", type=float, help="repeat every INTERVAL seconds")
+    args = parser.parse_args()
+    dev_path = get_dev_path()
+    if not dev_path:
+        print("No recognised device detected")
+        exit(1)
+    with open(dev_path, "rb", buffering=0) as handle:
+        while True:
+            try:
+                counters = read_counters(handle)
+            except OSError:
+                raise SystemExit("Firmware was built without DIAGNOSTICS")
+            print(", ".join(f"{name}: {value}" for name, value in counters.items()))
+            if not args.interval:
+                break
+            try:
+                time.sleep(args.interval)
+            except KeyboardInterrupt:
+                break
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,51 @@
+"""Print the event stream of firmware built with EVENTS.
+
+Events arrive on interrupt endpoint 3 in interface 1 of the device, which is
+claimed through usbfs. The joystick interface is left to hidraw, so this can
+run next to pedal-controller. See EVENT_STEP in src/core.h for the format.
+"""
+
+import argparse
+import struct
+
+from .usbfs import Device
+
+INTERFACE = 1
+ENDPOINT = 3
+EVENT_STEP = 1
+EVENT_DIAGNOSTICS = 2
+TYPES = {"step": EVENT_STEP, "diagnostics": EVENT_DIAGNOSTICS}
+
+
+def decode(packet):
+    if packet[0] == EVENT_STEP:
+        step, value, stamp = struct.unpack("<BHH", packet[1:6])
+        return f"step {step}, value {value}, time {stamp}"
+    if packet[0] == EVENT_DIAGNOSTICS:
+        resets, dropped, loops = struct.unpack("<BHI", packet[1:8])
+        return f"loops per second: {loops}, watchdog resets: {resets}, samples dropped: {dropped}"
+    return f"unknown event {packet.hex()}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-t", "--type", choices=TYPES, action="append",
+                        help="only show events of this type, can be repeated")
+    args = parser.parse_args()
+    wanted = {TYPES[name] for name in args.type} if args.type else set(TYPES.values())
+    with Device() as device:
+        try:
+            device.claim(INTERFACE)
+        except OSError:
+            raise SystemExit("Firmware was built without EVENTS, or the device is in use")
+        try:
+            while True:
+                packet = device.interrupt_in(ENDPOINT)
+                if packet and packet[0] in wanted:
+                    print(decode(packet), flush=True)
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
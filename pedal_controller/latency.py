@@ -0,0 +1,107 @@
+"""Measure sample age and jitter from firmware built with REPORT_TIMESTAMP.
+
+Device and host clocks are unrelated, so the absolute age of a sample can't
+be known. Instead the device timestamps are fitted to the host arrival times
+and every age is given relative to the youngest sample seen, which removes
+both the clock offset and the drift of the RC oscillator.
+"""
+
+import argparse
+import time
+
+from .__main__ import get_dev_path
+from .report import VENDOR, ReportDecoder, read_descriptor
+
+F_CPU = 16.5e6
+TIMESTAMPS = {
+    (VENDOR, 0x03): ("ticks", 64 / F_CPU),
+    (VENDOR, 0x04): ("overflows", 16384 / F_CPU),
+}
+
+
+def capture(dev_path, count):
+    """Return (host time, device time) in seconds for count reports."""
+    decoder = ReportDecoder(read_descriptor(dev_path))
+    usage = next((u for u in TIMESTAMPS if u in decoder.usages()), None)
+    if usage is None:
+        raise SystemExit("Firmware was built without REPORT_TIMESTAMP")
+    period = TIMESTAMPS[usage][1]
+    points = []
+    with open(dev_path, "rb", buffering=0) as handle:
+        for _ in range(count):
+            data = handle.read(64)
+            arrival = time.monotonic()
+            stamp = decoder.decode(data).values[usage][0]
+            points.append((arrival, stamp))
+    return unwrap(points, period)
+
+
+def unwrap(points, period):
+    """Extend the 16 bit device stamps using the host time between reports."""
+    wrap = 65536 * period
+    result = []
+    device = None
+    for arrival, stamp in points:
+        if device is None:
+            device = stamp * period
+        else:
+            elapsed = arrival - result[-1][0]
+            delta = (stamp * period - device) % wrap
+            delta += round((elapsed - delta) / wrap) * wrap
+            device += delta
+        result.append((arrival, device))
+    return result
+
+
+def fit(points):
+    """Least squares line host = slope * device + offset."""
+    n = len(points)
+    mean_host = sum(h for h, _ in points) / n
+    mean_device = sum(d for _, d in points) / n
+    covariance = sum((d - mean_device) * (h - mean_host) for h, d in points)
+    variance = sum((d - mean_device) ** 2 for _, d in points)
+    slope = covariance / variance if variance else 1.0
+    return slope, mean_host - slope * mean_device
+
+
+def histogram(title, values, width=0.5e-3, bar=50):
+    print(title)
+    if not values:
+        return
+    bins = {}
+    for value in values:
+        bins[int(value // width)] = bins.get(int(value // width), 0) + 1
+    peak = max(bins.values())
+    for index in range(min(bins), max(bins) + 1):
+        count = bins.get(index, 0)
+        label = f"{index * width * 1e3:7.1f} ms"
+        print(f"{label} {count:6d} {'#' * round(count * bar / peak)}")
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-n", "--count", type=int, default=1000, help="reports to capture")
+    args = parser.parse_args()
+    dev_path = get_dev_path()
+    if not dev_path:
+        print("No recognised device detected")
+        exit(1)
+    points = capture(dev_path, args.count)
+    slope, offset = fit(points)
+    ages = [h - (slope * d + offset) for h, d in points]
+    youngest = min(ages)
+    histogram("Sample age at arrival, relative to the youngest", [a - youngest for a in ages])
+    histogram(
+        "Interval between reports, host clock",
+        [b[0] - a[0] for a, b in zip(points, points[1:])],
+    )
+    histogram(
+        "Interval between samples, device clock",
+        [(b[1] - a[1]) * slope for a, b in zip(points, points[1:])],
+    )
+    print(f"Device clock runs {(1 / slope - 1) * 1e6:+.0f} ppm against the host")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+"""Decode diffjoy input reports using the device's HID report descriptor.
+
+The firmware can be built with different report layouts, so instead of
+hard-coding one, the fields are located by parsing the report descriptor
+the kernel exposes in sysfs.
+"""
+
+import os
+from dataclasses import dataclass, field
+
+GENERIC_DESKTOP = 0x01
+VENDOR = 0xFF00
+
+USAGE_X = (GENERIC_DESKTOP, 0x30)
+USAGE_SEQUENCE = (VENDOR, 0x01)
+USAGE_COUNT = (VENDOR, 0x02)
+
+MAIN, GLOBAL, LOCAL = 0, 1, 2
+INPUT, COLLECTION, END_COLLECTION = 0x8, 0xA, 0xC
+USAGE_PAGE, REPORT_SIZE, REPORT_ID, REPORT_COUNT = 0x0, 0x7, 0x8, 0x9
+USAGE = 0x0
+
+
+@dataclass
+class Field:
+    usage: tuple
+    offset: int
+    size: int
+
+    def extract(self, data):
+        value = int.from_bytes(data, "little") >> self.offset
+        return value & ((1 << self.size) - 1)
+
+
+@dataclass
+class Report:
+    samples: list
+    sequence: int = None
+    values: dict = field(default_factory=dict)
+
+
+def iter_items(descriptor):
+    pos = 0
+    while pos < len(descriptor):
+        prefix = descriptor[pos]
+        if prefix == 0xFE:  # long item, not used by HID class devices
+            pos += 3 + descriptor[pos + 1]
+            continue
+        size = (0, 1, 2, 4)[prefix & 3]
+        data = int.from_bytes(descriptor[pos + 1 : pos + 1 + size], "little")
+        yield (prefix >> 2) & 3, prefix >> 4, size, data
+        pos += 1 + size
+
+
+def parse_descriptor(descriptor):
+    """Map report ID (0 without IDs) to the list of its input fields."""
+    reports = {}
+    offsets = {}
+    usage_page = 0
+    report_size = 0
+    report_count = 0
+    report_id = 0
+    usages = []
+    for kind, tag, size, data in iter_items(descriptor):
+        if kind == GLOBAL:
+            if tag == USAGE_PAGE:
+                usage_page = data
+            elif tag == REPORT_SIZE:
+                report_size = data
+            elif tag == REPORT_COUNT:
+                report_count = data
+            elif tag == REPORT_ID:
+                report_id = data
+        elif kind == LOCAL and tag == USAGE:
+            usages.append((data >> 16, data & 0xFFFF) if size == 4 else (usage_page, data))
+        elif kind == MAIN:
+            if tag == INPUT:
+                offset = offsets.get(report_id, 8 if report_id else 0)
+                fields = reports.setdefault(report_id, [])
+                for i in range(report_count):
+                    if not data & 1 and usages:  # skip constant padding
+                        usage = usages[min(i, len(usages) - 1)]
+                        fields.append(Field(usage, offset, report_size))
+                    offset += report_size
+                offsets[report_id] = offset
+            usages = []
+    return reports
+
+
+class ReportDecoder:
+    def __init__(self, descriptor):
+        self.reports = parse_descriptor(descriptor)
+        self.numbered = any(self.reports)
+
+    def usages(self):
+        return {item.usage for fields in self.reports.values() for item in fields}
+
+    def decode(self, data):
+        report_id = data[0] if self.numbered else 0
+        values = {}
+        samples = []
+        for item in self.reports.get(report_id, []):
+            value = item.extract(data)
+            values.setdefault(item.usage, []).append(value)
+            if item.usage == USAGE_X:  # scaled to 16 bits whatever the build's depth
+                samples.append(value << max(16 - item.size, 0))
+        if USAGE_COUNT in values:
+            samples = samples[: values[USAGE_COUNT][0]]
+        sequence = values.get(USAGE_SEQUENCE, [None])[0]
+        return Report(samples, sequence, values)
+
+
+def read_descriptor(dev_path):
+    name = os.path.basename(dev_path)
+    path = os.path.join("/sys/class/hidraw", name, "device/report_descriptor")
+    with open(path, "rb") as handle:
+        return handle.read()
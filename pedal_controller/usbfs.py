@@ -0,0 +1,102 @@
+"""Talk to the diffjoy through Linux usbfs, for what hidraw can't reach.
+
+Only the ioctls needed here are wrapped, so no libusb binding is required.
+The USB device node is found through sysfs from the hidraw node of the
+joystick interface.
+"""
+
+import ctypes
+import fcntl
+import os
+
+from .__main__ import get_dev_path
+
+
+def _ioc(direction, number, size):
+    """_IOC(direction, 'U', number, size) from linux/ioctl.h"""
+    return (direction << 30) | (size << 16) | (ord("U") << 8) | number
+
+
+class CtrlTransfer(ctypes.Structure):
+    _fields_ = [
+        ("bRequestType", ctypes.c_uint8),
+        ("bRequest", ctypes.c_uint8),
+        ("wValue", ctypes.c_uint16),
+        ("wIndex", ctypes.c_uint16),
+        ("wLength", ctypes.c_uint16),
+        ("timeout", ctypes.c_uint32),
+        ("data", ctypes.c_void_p),
+    ]
+
+
+class BulkTransfer(ctypes.Structure):
+    _fields_ = [
+        ("ep", ctypes.c_uint),
+        ("len", ctypes.c_uint),
+        ("timeout", ctypes.c_uint),
+        ("data", ctypes.c_void_p),
+    ]
+
+
+USBDEVFS_CONTROL = _ioc(3, 0, ctypes.sizeof(CtrlTransfer))
+USBDEVFS_BULK = _ioc(3, 2, ctypes.sizeof(BulkTransfer))
+USBDEVFS_CLAIMINTERFACE = _ioc(2, 15, ctypes.sizeof(ctypes.c_uint))
+USBDEVFS_RELEASEINTERFACE = _ioc(2, 16, ctypes.sizeof(ctypes.c_uint))
+
+VENDOR_IN = 0xC0  # device to host, vendor request, recipient device
+VENDOR_OUT = 0x40  # host to device, vendor request, recipient device
+
+
+def usb_dev_path(hidraw_path):
+    """/dev/bus/usb node of the device a hidraw node belongs to."""
+    name = os.path.basename(hidraw_path)
+    hid = os.path.realpath(os.path.join("/sys/class/hidraw", name, "device"))
+    device = os.path.dirname(os.path.dirname(hid))  # HID device, interface, device
+    with open(os.path.join(device, "busnum")) as bus, open(os.path.join(device, "devnum")) as dev:
+        return f"/dev/bus/usb/{int(bus.read()):03d}/{int(dev.read()):03d}"
+
+
+class Device:
+    def __init__(self, path=None):
+        if path is None:
+            hidraw = get_dev_path()
+            if not hidraw:
+                raise SystemExit("No recognised device detected")
+            path = usb_dev_path(hidraw)
+        self.fd = os.open(path, os.O_RDWR)
+        self.claimed = []
+
+    def close(self):
+        for interface in self.claimed:
+            fcntl.ioctl(self.fd, USBDEVFS_RELEASEINTERFACE, ctypes.c_uint(interface))
+        os.close(self.fd)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def claim(self, interface):
+        fcntl.ioctl(self.fd, USBDEVFS_CLAIMINTERFACE, ctypes.c_uint(interface))
+        self.claimed.append(interface)
+
+    def control_in(self, request, length, value=0, index=0, timeout=1000):
+        buffer = ctypes.create_string_buffer(length)
+        transfer = CtrlTransfer(VENDOR_IN, request, value, index, length, timeout,
+                                ctypes.cast(buffer, ctypes.c_void_p))
+        count = fcntl.ioctl(self.fd, USBDEVFS_CONTROL, transfer)
+        return buffer.raw[:count]
+
+    def control_out(self, request, value=0, index=0, timeout=1000):
+        """A vendor request without data stage."""
+        transfer = CtrlTransfer(VENDOR_OUT, request, value, index, 0, timeout, None)
+        fcntl.ioctl(self.fd, USBDEVFS_CONTROL, transfer)
+
+    def interrupt_in(self, endpoint, length=8, timeout=0):
+        """Read one packet; the kernel turns a bulk call into an interrupt transfer."""
+        buffer = ctypes.create_string_buffer(length)
+        transfer = BulkTransfer(0x80 | endpoint, length, timeout,
+                                ctypes.cast(buffer, ctypes.c_void_p))
+        count = fcntl.ioctl(self.fd, USBDEVFS_BULK, transfer)
+        return buffer.raw[:count]
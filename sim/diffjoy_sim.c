@@ -0,0 +1,692 @@
+/* Name: diffjoy_sim.c
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Test bench for the diffjoy firmware on simavr. It runs main.bin on a
+ * simulated ATtiny45 at 16.5 MHz, feeds a synthetic waveform into PB3/PB4
+ * and acts as a low speed USB host on PB0/PB2: it resets the bus, sends a
+ * keep alive every 1 ms and polls the interrupt endpoint. All numbers are in
+ * simulated CPU cycles, so they are the same on every machine.
+ *
+ * The report layout is taken from config.h, so this file must be built with
+ * the same DEFINES as the firmware. See the Makefile in this directory.
+ *
+ * Given the symbol table of main.bin (-s, from avr-nm -n), it also profiles
+ * cycles per function and measures the stack depth by painting the free RAM.
+ * With -c, -d and -r it exits with status 3 if the firmware breaks a limit.
+ * With -e it starts warm: EEPROM holds an OSCCAL value proven against the
+ * host, so the firmware takes the short boot disconnect.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_ioport.h"
+#include "avr_adc.h"
+#include "avr_eeprom.h"
+
+#include "usbconfig.h"           /* and config.h, for the report layout */
+
+typedef unsigned char uchar;
+typedef avr_cycle_count_t cycle_t;
+
+#define F_CPU           16500000
+#define BIT             11          /* cycles per low speed bit, F_CPU / 1.5 MHz */
+#define FRAME           (F_CPU / 1000)
+#define US(cycles)      ((cycles) * 1e6 / F_CPU)
+
+#define DMINUS          USB_CFG_DMINUS_BIT
+#define DPLUS           USB_CFG_DPLUS_BIT
+#define USBMASK         ((1 << DMINUS) | (1 << DPLUS))
+#define REG_DDRB        0x37        /* data space addresses on the ATtiny45 */
+#define REG_PORTB       0x38
+#define VECTOR_INT0     2           /* byte address of the USB interrupt vector */
+#define RAMEND          0x15f
+#define PAINT           0xa5        /* fill pattern of the unused RAM */
+#define OP_WDR          0x95a8      /* wdt_reset(), once per main loop iteration */
+
+#define PID_IN          0x69
+#define PID_DATA0       0xc3
+#define PID_DATA1       0x4b
+#define PID_ACK         0xd2
+#define PID_NAK         0x5a
+
+enum { SE0, J, K, UNDRIVEN };       /* line states */
+
+typedef struct edge {
+    cycle_t cycle;
+    uchar   state;
+} edge_t;
+
+typedef struct stat {
+    unsigned long   count;
+    double          sum, min, max;
+} stat_t;
+
+static avr_t   *avr;
+static avr_irq_t *pinDminus, *pinDplus, *adcPlus, *adcMinus;
+
+static edge_t   txQueue[512];       /* line changes scheduled by the host */
+static int      txHead, txTail;
+static uchar    txState = J;
+static edge_t   rxEdges[512];       /* line changes while the device drives */
+static int      rxCount;
+static uchar    rxDriving;
+
+static cycle_t  responseDeadline;   /* waiting for an answer to an IN token */
+static cycle_t  syncCycle;          /* first K of the last token, raises INT0 */
+static uchar    latencyArmed;
+static uchar    running;            /* the device answered with data once */
+
+typedef struct symbol {
+    unsigned long   address;
+    char            name[48];
+    cycle_t         cycles;         /* spent in it while running */
+} symbol_t;
+
+static stat_t   int0Latency, stepLatency, cliBoot, cliRunning, cliUsb, loopTime;
+static cycle_t  cliStart, loopLast;
+static avr_flashaddr_t cliRunningPc, cliPc;
+static unsigned long reportCount, nakCount, lostCount, crcErrors;
+static cycle_t  firstReport;
+
+static const char *waveform = "step";
+static double   periodMs = 200, lowMv = 1000, highMv = 4000;
+static cycle_t  stepCycle;
+static int      stepDirection;      /* +1 rising, -1 falling, 0 none pending */
+static unsigned reportLow = 0xffff, reportHigh = 0;
+static uchar    verbose;
+
+static symbol_t *symbols;           /* text symbols, sorted by address */
+static int      symbolCount;
+static long     heapStart = -1;     /* __heap_start, end of the static data */
+
+/* ------------------------------------------------------------------------- */
+
+static void statAdd(stat_t *s, double value)
+{
+    if(!s->count || value < s->min)
+        s->min = value;
+    if(!s->count || value > s->max)
+        s->max = value;
+    s->sum += value;
+    s->count++;
+}
+
+static void statPrint(const char *name, stat_t *s)
+{
+    if(!s->count) {
+        printf("%-34s n/a\n", name);
+        return;
+    }
+    printf("%-34s min %8.1f  avg %8.1f  max %8.1f us  %7.0f cycles  (n=%lu)\n", name,
+           US(s->min), US(s->sum / s->count), US(s->max), s->max, s->count);
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------ USB host --------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static unsigned crc5(unsigned data, int bits)
+{
+    unsigned crc = 0x1f;
+
+    while(bits--) {
+        crc = ((crc ^ data) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+        data >>= 1;
+    }
+    return crc ^ 0x1f;
+}
+
+static unsigned crc16(const uchar *data, int len)
+{
+    unsigned crc = 0xffff;
+    int i;
+
+    while(len--) {
+        crc ^= *data++;
+        for(i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+    return crc ^ 0xffff;
+}
+
+static void txQueueAdd(cycle_t cycle, uchar state)
+{
+    txQueue[txTail].cycle = cycle;
+    txQueue[txTail].state = state;
+    txTail = (txTail + 1) % (sizeof(txQueue) / sizeof(txQueue[0]));
+}
+
+/* Queue a packet starting at cycle, NRZI encoded and bit stuffed. Returns
+ * the cycle at which the line is idle again.
+ */
+static cycle_t hostSend(cycle_t cycle, const uchar *data, int len)
+{
+    uchar   state = J;
+    int     ones = 0, i, bit;
+    uchar   byte = 0x80;            /* SYNC */
+
+    for(i = -1; i < len; i++) {
+        if(i >= 0)
+            byte = data[i];
+        for(bit = 0; bit < 8; bit++) {
+            if(byte & (1 << bit)) {
+                ones++;
+            } else {
+                state = state == J ? K : J;
+                ones = 0;
+            }
+            txQueueAdd(cycle, state);
+            cycle += BIT;
+            if(ones == 6) {         /* stuff a zero */
+                state = state == J ? K : J;
+                ones = 0;
+                txQueueAdd(cycle, state);
+                cycle += BIT;
+            }
+        }
+    }
+    txQueueAdd(cycle, SE0);         /* EOP */
+    cycle += 2 * BIT;
+    txQueueAdd(cycle, J);
+    return cycle + BIT;
+}
+
+static cycle_t hostKeepAlive(cycle_t cycle)
+{
+    txQueueAdd(cycle, SE0);
+    txQueueAdd(cycle + 2 * BIT, J);
+    return cycle + 3 * BIT;
+}
+
+static cycle_t hostIn(cycle_t cycle, uchar address, uchar endpoint)
+{
+    unsigned token = address | endpoint << 7;
+    uchar packet[3];
+
+    token |= crc5(token, 11) << 11;
+    packet[0] = PID_IN;
+    packet[1] = token;
+    packet[2] = token >> 8;
+    syncCycle = cycle;              /* the first K of SYNC */
+    latencyArmed = 1;
+    cycle = hostSend(cycle, packet, sizeof(packet));
+    responseDeadline = cycle + 20 * BIT;
+    return cycle;
+}
+
+static void hostDrive(uchar state)
+{
+    if(state == txState)
+        return;
+    avr_raise_irq(pinDminus, state == J);
+    avr_raise_irq(pinDplus, state == K);
+    txState = state;
+}
+
+static void hostTick(void)
+{
+    while(txHead != txTail && txQueue[txHead].cycle <= avr->cycle) {
+        hostDrive(txQueue[txHead].state);
+        txHead = (txHead + 1) % (sizeof(txQueue) / sizeof(txQueue[0]));
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Undo NRZI and bit stuffing on the recorded line changes. The first change
+ * is the first K of SYNC. Returns the number of bytes after SYNC.
+ */
+static int rxDecode(uchar *data, int size)
+{
+    int     i, k, length, bits = 0, ones = 0;
+    uchar   bytes[64];
+
+    memset(bytes, 0, sizeof(bytes));
+    for(i = 0; i + 1 < rxCount && rxEdges[i].state != SE0; i++) {
+        length = (rxEdges[i + 1].cycle - rxEdges[i].cycle + BIT / 2) / BIT;
+        for(k = 0; k < length && bits < 8 * (int)sizeof(bytes); k++) {
+            if(k == 0) {
+                if(ones == 6) {     /* stuffed zero */
+                    ones = 0;
+                    continue;
+                }
+                ones = 0;
+            } else {
+                bytes[bits / 8] |= 1 << (bits % 8);
+                ones++;
+            }
+            bits++;
+        }
+    }
+    if(bits < 16 || bytes[0] != 0x80)
+        return 0;
+    bits = bits / 8 - 1;
+    if(bits > size)
+        bits = size;
+    memcpy(data, bytes + 1, bits);
+    return bits;
+}
+
+static void newReport(const uchar *data, int len)
+{
+    unsigned long   bits = 0;
+    unsigned        value, threshold;
+    int             i;
+
+    if(len < REPORT_SIZE || (REPORT_IDS && data[0] != 1))
+        return;                     /* short, or not REPORT_ID_JOYSTICK */
+    /* the newest sample is in the last batch slot, see report.h */
+    for(i = (REPORT_NEWEST_BIT + REPORT_AXIS_BITS - 1) / 8; i >= REPORT_NEWEST_BIT / 8; i--)
+        bits = bits << 8 | data[i];
+    value = (bits >> REPORT_NEWEST_BIT % 8 & REPORT_AXIS_MAX) << (16 - REPORT_AXIS_BITS);
+    if(!reportCount++)
+        firstReport = avr->cycle;
+    if(verbose)
+        printf("%10.1f us report %5u\n", US(avr->cycle), value);
+    if(value < reportLow)
+        reportLow = value;
+    if(value > reportHigh)
+        reportHigh = value;
+    threshold = (reportLow + reportHigh) / 2;
+    if(reportHigh - reportLow > 0x1000 && stepDirection
+       && (stepDirection > 0 ? value > threshold : value < threshold)) {
+        statAdd(&stepLatency, avr->cycle - stepCycle);
+        stepDirection = 0;
+    }
+}
+
+static void rxPacket(void)
+{
+    uchar   data[16];
+    int     len = rxDecode(data, sizeof(data));
+    uchar   ack = PID_ACK;
+
+    if(!responseDeadline || !len)
+        return;                     /* not an answer, e.g. the boot disconnect */
+    responseDeadline = 0;
+    if(data[0] == PID_NAK) {
+        nakCount++;
+    } else if(data[0] == PID_DATA0 || data[0] == PID_DATA1) {
+        if(len < 3 || crc16(data + 1, len - 3) != (unsigned)(data[len - 2] | data[len - 1] << 8)) {
+            crcErrors++;
+            return;
+        }
+        hostSend(avr->cycle + 3 * BIT, &ack, 1);
+        running = 1;
+        newReport(data + 1, len - 3);
+    }
+}
+
+/* Record the line while the device drives it and decode the packet when it
+ * lets go again.
+ */
+static void rxTick(void)
+{
+    uchar ddr = avr->data[REG_DDRB] & USBMASK;
+    uchar port = avr->data[REG_PORTB];
+    uchar state;
+
+    if(ddr == USBMASK) {
+        state = (port & (1 << DPLUS)) ? K : (port & (1 << DMINUS)) ? J : SE0;
+        if(!rxDriving) {
+            rxDriving = 1;
+            rxCount = 0;
+        }
+        if((rxCount == 0 && state != J)
+           || (rxCount > 0 && rxEdges[rxCount - 1].state != state)) {
+            if(rxCount < (int)(sizeof(rxEdges) / sizeof(rxEdges[0]))) {
+                rxEdges[rxCount].cycle = avr->cycle;
+                rxEdges[rxCount].state = state;
+                rxCount++;
+            }
+        }
+    } else if(rxDriving) {
+        rxDriving = 0;
+        txState = UNDRIVEN;         /* the device left the pins anywhere */
+        hostDrive(J);
+        rxPacket();
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------ Monitoring ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Called before every instruction. The I flag is cleared by cli and by every
+ * interrupt entry. Windows which start at the USB interrupt vector are the
+ * driver itself and counted apart: usbdrvasm165.inc only limits how long the
+ * rest of the firmware may delay it. Main loop iterations are timed from one
+ * wdr to the next, interrupts included.
+ */
+static void monitorTick(cycle_t cycle)
+{
+    if(!avr->sreg[S_I]) {
+        if(!cliStart) {
+            cliStart = cycle;
+            cliPc = avr->pc;
+        }
+    } else if(cliStart) {
+        stat_t *s = !running ? &cliBoot : cliPc == VECTOR_INT0 ? &cliUsb : &cliRunning;
+
+        if(s == &cliRunning && (!s->count || cycle - cliStart > s->max))
+            cliRunningPc = cliPc;
+        statAdd(s, cycle - cliStart);
+        cliStart = 0;
+    }
+    if(running && (avr->flash[avr->pc] | avr->flash[avr->pc + 1] << 8) == OP_WDR) {
+        if(loopLast)
+            statAdd(&loopTime, cycle - loopLast);
+        loopLast = cycle;
+    }
+    if(avr->pc == VECTOR_INT0 && latencyArmed) {
+        if(running)
+            statAdd(&int0Latency, cycle - syncCycle);
+        latencyArmed = 0;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Profiling ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Read "address type name" lines as written by avr-nm -n */
+static void symbolsLoad(const char *path)
+{
+    FILE            *file = fopen(path, "r");
+    char            line[128], name[64], type;
+    unsigned long   address;
+
+    if(!file) {
+        perror(path);
+        exit(1);
+    }
+    while(fgets(line, sizeof(line), file)) {
+        if(sscanf(line, "%lx %c %63s", &address, &type, name) != 3)
+            continue;
+        if(!strcmp(name, "__heap_start"))
+            heapStart = address & 0xffff;
+        if(address >= 0x800000 || (type != 't' && type != 'T'))
+            continue;               /* data space or not code */
+        symbols = realloc(symbols, (symbolCount + 1) * sizeof(symbol_t));
+        symbols[symbolCount].address = address;
+        snprintf(symbols[symbolCount].name, sizeof(symbols[0].name), "%s", name);
+        symbols[symbolCount].cycles = 0;
+        symbolCount++;
+    }
+    fclose(file);
+}
+
+static symbol_t *symbolFind(unsigned long pc)
+{
+    int lo = 0, hi = symbolCount - 1;
+
+    if(!symbolCount || pc < symbols[0].address)
+        return NULL;
+    while(lo < hi) {                /* last symbol at or below pc */
+        int mid = (lo + hi + 1) / 2;
+
+        if(symbols[mid].address <= pc)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return &symbols[lo];
+}
+
+static int symbolCompare(const void *a, const void *b)
+{
+    cycle_t x = ((const symbol_t *)a)->cycles, y = ((const symbol_t *)b)->cycles;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void profilePrint(cycle_t total)
+{
+    int i;
+
+    if(!total)
+        return;
+    qsort(symbols, symbolCount, sizeof(symbol_t), symbolCompare);
+    printf("\ncycles per function while running:\n");
+    for(i = 0; i < symbolCount && symbols[i].cycles; i++)
+        printf("  %-32s %12llu  %5.1f %%\n", symbols[i].name,
+               (unsigned long long)symbols[i].cycles, 100.0 * symbols[i].cycles / total);
+    printf("\n");
+}
+
+/* Fill the RAM above the static data before the firmware starts. Whatever is
+ * not the pattern anymore at the end has been used by the stack.
+ */
+static void stackPaint(void)
+{
+    long a;
+
+    for(a = heapStart; a <= RAMEND; a++)
+        avr->data[a] = PAINT;
+}
+
+static long stackLowest(void)
+{
+    long a = heapStart;
+
+    while(a <= RAMEND && avr->data[a] == PAINT)
+        a++;
+    return a;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Waveform -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* PB4 (ADC2) gets the waveform, PB3 (ADC3) its complement, so both the
+ * single ended and the differential build see the same signal.
+ */
+static void analogSet(double mv)
+{
+    avr_raise_irq(adcPlus, (uint32_t)mv);
+    avr_raise_irq(adcMinus, (uint32_t)(5000 - mv));
+}
+
+static cycle_t analogTick(cycle_t cycle)
+{
+    cycle_t period = periodMs * F_CPU / 1000;
+    double  phase = (double)(cycle % period) / period;
+
+    if(!strcmp(waveform, "step")) {
+        int high = phase < 0.5;
+
+        analogSet(high ? highMv : lowMv);
+        if(running) {
+            stepCycle = cycle;
+            stepDirection = high ? 1 : -1;
+        }
+        return cycle - cycle % (period / 2) + period / 2;
+    } else if(!strcmp(waveform, "ramp")) {
+        analogSet(lowMv + (highMv - lowMv) * phase);
+    } else {
+        analogSet(lowMv + (highMv - lowMv) * (0.5 - 0.5 * cos(2 * M_PI * phase)));
+    }
+    return cycle + F_CPU / 10000;   /* 100 us steps */
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-i poll_ms] [-w step|ramp|sine] [-p period_ms]\n"
+                    "          [-l low_mv] [-h high_mv] [-v] [-e] [-s main.sym]\n"
+                    "          [-c max_cli_cycles] [-d max_int0_cycles] [-r min_free_ram] main.bin\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    elf_firmware_t  firmware;
+    double          seconds = 5;
+    int             pollInterval = USB_CFG_INTR_POLL_INTERVAL, opt;
+    cycle_t         end, connected = 0, resetEnd = 0, nextFrame = 0, nextAnalog = 0;
+    unsigned long   frame = 0;
+    uchar           sawDisconnect = 0, warmStart = 0;
+    long            maxCli = -1, maxLatency = -1, minFreeRam = -1, lowest = 0;
+    cycle_t         profiled = 0;
+    int             failed = 0;
+
+    while((opt = getopt(argc, argv, "t:i:w:p:l:h:ves:c:d:r:")) != -1) {
+        switch(opt) {
+        case 't': seconds = atof(optarg); break;
+        case 'i': pollInterval = atoi(optarg); break;
+        case 'w': waveform = optarg; break;
+        case 'p': periodMs = atof(optarg); break;
+        case 'l': lowMv = atof(optarg); break;
+        case 'h': highMv = atof(optarg); break;
+        case 'v': verbose = 1; break;
+        case 'e': warmStart = 1; break;
+        case 's': symbolsLoad(optarg); break;
+        case 'c': maxCli = atol(optarg); break;
+        case 'd': maxLatency = atol(optarg); break;
+        case 'r': minFreeRam = atol(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || pollInterval < 1)
+        usage(argv[0]);
+    memset(&firmware, 0, sizeof(firmware));
+    if(elf_read_firmware(argv[optind], &firmware)) {
+        fprintf(stderr, "can't load %s\n", argv[optind]);
+        return 1;
+    }
+    avr = avr_make_mcu_by_name("attiny45");
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = F_CPU;
+    if(warmStart) {
+        /* OSCCAL in location 0 and its complement in 1, as written by
+         * usbEventResetReady(). The simulated clock ignores the value.
+         */
+        uchar               calibration[2] = { 0x80, 0x7f };
+        avr_eeprom_desc_t   eeprom = { .ee = calibration, .offset = 0, .size = 2 };
+
+        avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &eeprom);
+    }
+    avr->vcc = avr->avcc = avr->aref = 5000;
+    pinDminus = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), DMINUS);
+    pinDplus = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), DPLUS);
+    adcPlus = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC2);
+    adcMinus = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC3);
+    avr_raise_irq(pinDminus, 1);    /* idle J through the host's pull down */
+    avr_raise_irq(pinDplus, 0);     /* and the device's pull up on D- */
+    if(heapStart >= 0)
+        stackPaint();
+
+    end = seconds * F_CPU;
+    while(avr->cycle < end) {
+        cycle_t cycle = avr->cycle;
+        int     state;
+
+        if(cycle >= nextAnalog)
+            nextAnalog = analogTick(cycle);
+        /* The host waits for the boot disconnect to end, resets the bus for
+         * 10 ms and then starts sending frames.
+         */
+        if(!connected) {
+            uchar ddr = avr->data[REG_DDRB] & USBMASK;
+
+            if(ddr)
+                sawDisconnect = 1;
+            else if(sawDisconnect)
+                connected = cycle;
+        } else if(!resetEnd && cycle >= connected + 10 * FRAME) {
+            txQueueAdd(cycle, SE0);
+            resetEnd = cycle + 10 * FRAME;
+            txQueueAdd(resetEnd, J);
+            nextFrame = resetEnd + FRAME;
+        } else if(resetEnd && cycle >= nextFrame && txHead == txTail && !rxDriving) {
+            cycle_t t = hostKeepAlive(cycle);
+
+            if(responseDeadline) {  /* the device never answered */
+                lostCount++;
+                responseDeadline = 0;
+            }
+            if(++frame % pollInterval == 0)
+                hostIn(t + 2 * BIT, 0, 1);
+            nextFrame += FRAME;
+        }
+        if(responseDeadline && cycle > responseDeadline && !rxDriving) {
+            lostCount++;
+            responseDeadline = 0;
+        }
+        hostTick();
+        monitorTick(cycle);
+        {
+            symbol_t *function = running ? symbolFind(avr->pc) : NULL;
+
+            state = avr_run(avr);
+            if(function) {
+                function->cycles += avr->cycle - cycle;
+                profiled += avr->cycle - cycle;
+            }
+        }
+        if(state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "simulation stopped at pc 0x%04x\n", (unsigned)avr->pc);
+            return 1;
+        }
+        rxTick();
+    }
+
+    printf("%.1f s simulated, %s waveform, polled every %d ms, %s start\n", seconds, waveform,
+           pollInterval, warmStart ? "warm" : "cold");
+    if(connected)
+        printf("%-34s %.1f ms\n", "connected after", US(connected) / 1000);
+    if(reportCount)
+        printf("%-34s %.1f ms\n", "first report after", US(firstReport) / 1000);
+    printf("%-34s %lu data, %lu NAK, %lu unanswered, %lu CRC errors\n", "IN transactions",
+           reportCount, nakCount, lostCount, crcErrors);
+    if(reportCount > 1)
+        printf("%-34s %.1f\n", "reports per second",
+               (reportCount - 1) * (double)F_CPU / (end - firstReport));
+    statPrint("step to report latency", &stepLatency);
+    statPrint("main loop iteration", &loopTime);
+    statPrint("INT0 latency from SYNC", &int0Latency);
+    statPrint("interrupts disabled, boot", &cliBoot);
+    statPrint("interrupts disabled, USB interrupt", &cliUsb);
+    statPrint("interrupts disabled, elsewhere", &cliRunning);
+    if(cliRunning.count) {
+        symbol_t *function = symbolFind(cliRunningPc);
+
+        printf("%-34s 0x%04x %s\n", "longest of those starts at", (unsigned)cliRunningPc,
+               function ? function->name : "");
+    }
+    if(heapStart >= 0) {
+        lowest = stackLowest();
+        printf("%-34s %ld bytes, %ld bytes free above the static data\n", "peak stack depth",
+               RAMEND + 1 - lowest, lowest - heapStart);
+    }
+    profilePrint(profiled);
+
+    if(!reportCount) {
+        printf("LIMIT: no report received\n");
+        return 1;
+    }
+    if(maxCli >= 0 && cliRunning.count && cliRunning.max > maxCli) {
+        printf("LIMIT: interrupts disabled for %.0f cycles, limit %ld\n", cliRunning.max, maxCli);
+        failed = 1;
+    }
+    if(maxLatency >= 0 && int0Latency.count && int0Latency.max > maxLatency) {
+        printf("LIMIT: INT0 latency %.0f cycles, limit %ld\n", int0Latency.max, maxLatency);
+        failed = 1;
+    }
+    if(minFreeRam >= 0 && heapStart >= 0 && lowest - heapStart < minFreeRam) {
+        printf("LIMIT: %ld bytes of RAM free, limit %ld\n", lowest - heapStart, minFreeRam);
+        failed = 1;
+    }
+    return failed ? 3 : 0;
+}
@@ -0,0 +1,323 @@
+/* Name: config.h
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Build time options of the diffjoy firmware. Every option can be overridden
+ * from the make command line, e.g. "make DEFINES=-DADC_DIFFERENTIAL=1".
+ */
+#ifndef __config_h_included__
+#define __config_h_included__
+
+/* ----------------------------- Boot Config ------------------------------- */
+
+#ifndef BOOT_DISCONNECT_MS
+#define BOOT_DISCONNECT_MS      300
+#endif
+/* How long USB is held disconnected on a cold start, which also gives the RC
+ * oscillator time to stabilize.
+ */
+#ifndef BOOT_WARM_DISCONNECT_MS
+#define BOOT_WARM_DISCONNECT_MS 20
+#endif
+/* Disconnect time after a watchdog reset, or when EEPROM holds an OSCCAL
+ * value that was measured against the host. The oscillator is then known to
+ * be good and the host only needs to notice that the device went away.
+ */
+
+/* ------------------------------ ADC Config ------------------------------- */
+
+#ifndef ADC_DIFFERENTIAL
+#define ADC_DIFFERENTIAL        0
+#endif
+/* Define this to 1 to measure PB4 - PB3 with the differential input stage of
+ * the ADC (ADC2 - ADC3) in one conversion per sample instead of converting
+ * both inputs single ended. Like the single ended build, which reports PB4,
+ * the result rises as PB4 does. Set it to 0 for the single ended pair.
+ */
+#ifndef ADC_DIFF_GAIN
+#define ADC_DIFF_GAIN           1
+#endif
+/* Gain of the differential input stage, either 1 or 20.
+ */
+#ifndef ADC_DIFF_BIPOLAR
+#define ADC_DIFF_BIPOLAR        1
+#endif
+/* Define this to 1 to convert differences of both signs. The signed result is
+ * reported in offset binary, i.e. 512 means no difference, 0 is PB3 at full
+ * scale above PB4 and 1023 is PB4 at full scale above PB3. Define it to 0 to
+ * use the unipolar mode, which doubles the resolution but reports any
+ * difference with PB3 above PB4 as 0.
+ */
+#ifndef ADC_OVERSAMPLE
+#define ADC_OVERSAMPLE          16
+#endif
+/* Number of conversions summed into one sample, either 1, 4, 16 or 64. Each
+ * factor of four adds one bit of resolution (10 to 13 bits) as long as the
+ * input carries about one LSB of noise. Samples are always stretched to the
+ * full 16 bit range of the report. The ADC clock stays at clk/128, within the
+ * 200 kHz it needs for full resolution, and a complete sample must fit into
+ * USB_CFG_INTR_POLL_INTERVAL: 64 only fits with ADC_DIFFERENTIAL.
+ */
+#ifndef ADC_TRIGGER
+#define ADC_TRIGGER             0
+#endif
+/* Define this to 1 to start conversions from Timer0 compare match A at a
+ * fixed ADC_SAMPLE_RATE instead of from the main loop. Sample spacing is then
+ * set by hardware and no longer depends on how busy the main loop is; the
+ * ADC interrupt queues the results in a small ring buffer. The single ended
+ * pair is interleaved conversion by conversion in this mode. At the default
+ * rate a pair takes 8 ms instead of 3.5, so in the bench a step reaches its
+ * midpoint about 10 ms later.
+ */
+#ifndef ADC_SAMPLE_RATE
+#define ADC_SAMPLE_RATE         4000
+#endif
+/* Conversions per second when ADC_TRIGGER is 1. The pair needs
+ * 2 * ADC_OVERSAMPLE conversions per sample, the differential mode
+ * ADC_OVERSAMPLE. The rate is rounded to the nearest one Timer0 can generate.
+ * At most about 4950, as a conversion at clk/128 must fit into half a period.
+ */
+
+#ifndef TEMP_COMPENSATION
+#define TEMP_COMPENSATION       0
+#endif
+/* Define this to 1 to convert the internal temperature sensor (ADC4) every
+ * TEMP_INTERVAL_MS between two samples and correct every sample by the drift
+ * in the calibration record, see calibration_t. The identity calibration has
+ * no drift. Not available with ADC_TRIGGER. Each reading costs 8 conversions,
+ * as the sensor needs the 1.1 V reference and the switch to and from it
+ * takes two conversions to settle.
+ */
+#ifndef TEMP_INTERVAL_MS
+#define TEMP_INTERVAL_MS        1000
+#endif
+/* Time between temperature readings in ms, at most 65535. */
+
+/* ----------------------------- Filter Config ----------------------------- */
+
+#ifndef FILTER_MEDIAN
+#define FILTER_MEDIAN           1
+#endif
+/* Define this to 1 to replace each sample by the median of it and the two
+ * before it. This removes single sample spikes at the cost of one sample of
+ * delay. With ADC_TRIGGER the median runs on each channel's conversions
+ * before they are summed instead, as the interleaved pair spreads a spike
+ * over several samples; that costs 8 bytes of RAM and no sample of delay.
+ */
+#ifndef FILTER_EMA_SHIFT
+#define FILTER_EMA_SHIFT        2
+#endif
+/* Smooth the samples with an exponential moving average, alpha being
+ * 1 / 2^FILTER_EMA_SHIFT. The time constant is about 2^FILTER_EMA_SHIFT
+ * samples. 0 disables the average.
+ */
+
+/* ----------------------------- Motion Config ----------------------------- */
+
+#ifndef MOTION_REST_MS
+#define MOTION_REST_MS          0
+#endif
+/* While the pedal rests, pause this long between samples instead of starting
+ * the next one right away, which cuts ADC and main loop work by about three
+ * quarters. The first sample that shows motion ends the rest, so the pedal
+ * is sampled at full rate again from the next sample on; only the start of a
+ * movement can be seen up to MOTION_REST_MS late. With POLL_LOCK the rest
+ * ends early, so that the next sample completes just before a poll; at up to
+ * one poll interval the rest then doesn't delay the pair's reports. At most
+ * 250 with POLL_LOCK. 0 always samples at full rate; try 10. ADC_TRIGGER
+ * keeps its fixed rate regardless.
+ */
+#ifndef MOTION_THRESHOLD
+#define MOTION_THRESHOLD        128
+#endif
+/* Motion means a sample differs from the filtered value by more than this, in
+ * 16 bit report units (64 is one LSB of a 10 bit conversion). It must stay
+ * above the noise, or the pedal never rests.
+ */
+#ifndef MOTION_STILL_SAMPLES
+#define MOTION_STILL_SAMPLES    64
+#endif
+/* Samples without motion before the pedal counts as resting, at most 255. */
+
+/* ----------------------------- Report Config ----------------------------- */
+
+#ifndef REPORT_DEADBAND
+#define REPORT_DEADBAND         64
+#endif
+/* A new sample is only reported when it differs from the last report by more
+ * than this, in 16 bit report units (64 is one LSB of a 10 bit conversion).
+ * Smaller changes are delivered with the next idle report. Define it to 0 to
+ * report every change. A calibration record in EEPROM overrides it.
+ */
+#ifndef REPORT_IDLE_RATE
+#define REPORT_IDLE_RATE        125
+#endif
+/* Idle rate in 4 ms units until the host sets its own with SET_IDLE. While
+ * the value doesn't move, the last sample is repeated at this rate. 0 means
+ * reports are only sent on change.
+ */
+#ifndef REPORT_BATCH
+#define REPORT_BATCH            1
+#endif
+/* Number of samples per interrupt report, 1..3. With more than one, a
+ * sample count and by default a sequence number are added, and the report
+ * grows to 2 + 2 * REPORT_BATCH bytes. Samples completed between two host
+ * polls are then all delivered instead of only the newest, and the host can
+ * detect lost reports from gaps in the sequence.
+ */
+#ifndef REPORT_TIMESTAMP
+#define REPORT_TIMESTAMP        0
+#endif
+/* Append the time the newest sample in a report was completed, as 16 bits:
+ *   0: no timestamp
+ *   1: Timer1 ticks of 64 clock cycles (3.9 us), wrapping after 254 ms
+ *   2: Timer1 overflows of 16384 clock cycles (0.99 ms), wrapping after 65 s
+ * The host can relate these to its own arrival times to measure sample age
+ * and jitter. Not available together with REPORT_BATCH 3.
+ */
+#ifndef REPORT_SEQUENCE
+#define REPORT_SEQUENCE         (REPORT_BATCH > 1)
+#endif
+/* Add an 8 bit sequence number counting interrupt reports, from which the
+ * host can tell lost reports.
+ */
+#ifndef REPORT_AXES
+#define REPORT_AXES             1
+#endif
+/* 1 reports the pedal as X. 2 adds the PB3 input as Y, calibrated per channel
+ * but neither filtered nor mapped to the travel, to watch both inputs from
+ * the host. Y needs the two inputs converted separately, ADC_DIFFERENTIAL 0.
+ */
+#ifndef REPORT_AXIS_BITS
+#define REPORT_AXIS_BITS        16
+#endif
+/* Bits per axis value, 8..16. Values keep their upper bits, so the logical
+ * maximum becomes 2^bits - 1. Fields are packed without gaps and the report
+ * is padded to whole bytes at the end, so with 10 bits three samples fit
+ * where two did before.
+ */
+#ifndef REPORT_BUTTON
+#define REPORT_BUTTON           0
+#endif
+/* Define this to 1 to add button 1, pressed while the pedal is past half its
+ * travel, for software that only maps buttons. It is released below 7/16, so
+ * noise at the threshold doesn't make it chatter.
+ */
+/* These options, and REPORT_BATCH and REPORT_TIMESTAMP, define the layout of
+ * the joystick report; report.h derives the HID descriptor from them. They
+ * can also be set as make variables, see report.mk.
+ */
+#ifndef REPORT_CURVE
+#define REPORT_CURVE            0
+#endif
+/* Response curve applied to every report, as a piecewise linear table of 16
+ * segments in flash:
+ *   0: none
+ *   1: linear (the table equivalent of 0, for comparison)
+ *   2: S-curve (smoothstep), fine control near both ends of the travel
+ *   3: dead zone of REPORT_DEADZONE segments on both sides of the centre,
+ *      linear outside of it
+ */
+#ifndef REPORT_DEADZONE
+#define REPORT_DEADZONE         1
+#endif
+/* Half width of the dead zone of curve 3 in 1/16 of the travel, 1..7.
+ */
+#ifndef POLL_LOCK
+#define POLL_LOCK               0
+#endif
+/* Define this to 1 to learn when the host polls the interrupt endpoint, from
+ * the moments it takes a report, and hold each report back until
+ * POLL_LEAD_US before the next expected poll instead of loading it as soon
+ * as the endpoint is free, where it would wait for a whole poll interval.
+ * Samples completed in the meantime replace the held one. After 127 ms
+ * without a report taken, the phase is relearned. With REPORT_BATCH above 1,
+ * a full batch is sent right away.
+ */
+#ifndef POLL_LEAD_US
+#define POLL_LEAD_US            1000
+#endif
+/* How long before the expected poll a report is loaded, in us. A report
+ * loaded too late goes out one poll later, so this must cover the jitter of
+ * the host's polls within their frames.
+ */
+
+/* --------------------------- Diagnostics Config -------------------------- */
+
+#ifndef DIAGNOSTICS
+#define DIAGNOSTICS             0
+#endif
+/* Define this to 1 to count main loop and ADC activity and expose the counters
+ * as HID feature report 2, see diagnostics_t in core.h. Report IDs are then
+ * in use, so the joystick report becomes report 1 and grows by one byte,
+ * which leaves no room for REPORT_BATCH 3, nor for REPORT_BATCH 2 together
+ * with REPORT_TIMESTAMP.
+ * Costs 15 bytes of RAM and a Timer1 read per main loop iteration.
+ */
+
+/* ---------------------------- Keyboard Config ---------------------------- */
+
+#ifndef KEYBOARD
+#define KEYBOARD                0
+#endif
+/* Define this to 1 to add a keyboard to the joystick, or to 2 for a keyboard
+ * only, and type the keys of pedal_controller on the device itself: travel
+ * is cut into KEYBOARD_STEPS steps, a step up types '>', a step down '<' and
+ * entering or leaving step 0 types a space (US layout). Keyboard reports
+ * share the interrupt endpoint with the joystick as report 3, so KEYBOARD 1
+ * turns report IDs on like DIAGNOSTICS does. Costs 8 bytes of RAM.
+ */
+#ifndef KEYBOARD_STEPS
+#define KEYBOARD_STEPS          9
+#endif
+/* Number of steps the travel is cut into for KEYBOARD, at most 255. */
+
+/* ----------------------------- Event Config ------------------------------ */
+
+#ifndef EVENTS
+#define EVENTS                  0
+#endif
+/* Define this to 1 to enable interrupt endpoint 3 and send events on it: a
+ * step event whenever the reported value crosses into another of EVENT_STEPS
+ * steps, and with DIAGNOSTICS a summary of the counters every
+ * EVENT_DIAGNOSTICS_MS. The endpoint sits in a vendor class interface of its
+ * own, so the joystick on endpoint 1 never waits for it and host programs
+ * can claim either without disturbing the other. See core.h for the format.
+ * Costs 11 bytes of RAM in the driver and 12 in the firmware.
+ */
+#ifndef EVENT_STEPS
+#define EVENT_STEPS             KEYBOARD_STEPS
+#endif
+/* Number of steps the travel is cut into for step events, at most 255. */
+#ifndef EVENT_DIAGNOSTICS_MS
+#define EVENT_DIAGNOSTICS_MS    1000
+#endif
+/* Period of the diagnostics event in ms, 0 to never send it. At most 65535. */
+
+/* ---------------------------- Capture Config ----------------------------- */
+
+#ifndef CAPTURE
+#define CAPTURE                 0
+#endif
+/* Define this to 1 to support burst captures: on RQ_CAPTURE_START the main
+ * loop stops everything else and converts one input back to back, at clk/128
+ * (9.9 kS/s, the fastest ADC clock under 200 kHz), into RAM. RQ_CAPTURE_READ
+ * then returns the raw conversions, see capture_t in core.h.
+ * Costs 2 * CAPTURE_SAMPLES + 5 bytes of RAM, which the default options
+ * only leave for a few samples.
+ */
+#ifndef CAPTURE_SAMPLES
+#define CAPTURE_SAMPLES         8
+#endif
+/* Conversions per capture, at most 125 so that a capture fits one control
+ * transfer. The 256 bytes of RAM are the real limit: the firmware build fails
+ * if the static data leaves less than STACK_RESERVE (src/Makefile) for the
+ * stack, and "make -C sim profile" checks the stack depth it measures. Drop
+ * other options, like DIAGNOSTICS, before raising it.
+ */
+
+/* Report IDs are needed as soon as there is more than one report */
+#define REPORT_IDS              (DIAGNOSTICS || KEYBOARD == 1)
+
+#endif /* __config_h_included__ */
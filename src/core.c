@@ -0,0 +1,1406 @@
+/* Name: core.c
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Everything between the ADC and the bytes handed to the USB driver: the
+ * conversion sequence, calibration, filter, response curve, report building
+ * and the control requests. See core.h for the interface to the platform.
+ *
+ * The host build has 32 bit ints. Nothing here depends on 16 bit overflow,
+ * except the millisecond and tick timestamps, which wrap later on the host.
+ */
+
+#include <avr/pgmspace.h>
+
+#include "core.h"
+
+calibration_t           calibration;
+static calibration_t    calibrationNew; /* received by usbFunctionWrite() */
+static uchar            calibrationReceived;
+uchar                   calibrationUnsaved; /* bytes left to write to EEPROM */
+static unsigned long    travelScale;
+
+#if DIAGNOSTICS
+diagnostics_t           diagnostics;
+unsigned int            loopTicksMax;
+#endif
+
+#if TEMP_COMPENSATION
+static unsigned int     temperature;    /* last sensor reading, 0 before the first */
+#endif
+
+#if CAPTURE
+#if CAPTURE_SAMPLES < 2 || CAPTURE_SAMPLES > 125
+#error "CAPTURE_SAMPLES must be 2..125"
+#endif
+capture_t               capture;
+uchar                   captureRequest;
+#endif
+
+#if REPORT_BATCH < 1 || REPORT_BATCH > 3
+#error "REPORT_BATCH must be 1..3"
+#endif
+#if REPORT_TIMESTAMP < 0 || REPORT_TIMESTAMP > 2
+#error "REPORT_TIMESTAMP must be 0..2"
+#endif
+#if REPORT_AXES < 1 || REPORT_AXES > 2
+#error "REPORT_AXES must be 1 or 2"
+#elif REPORT_AXES > ADC_CHANNELS
+#error "REPORT_AXES 2 needs both inputs, ADC_DIFFERENTIAL 0"
+#endif
+#if REPORT_AXIS_BITS < 8 || REPORT_AXIS_BITS > 16
+#error "REPORT_AXIS_BITS must be 8..16"
+#endif
+#if REPORT_SIZE > 8
+#error "Report exceeds 8 bytes, shrink the layout in config.h or drop DIAGNOSTICS or KEYBOARD"
+#endif
+
+/* Keyboard reports go through the same buffer */
+#if KEYBOARD && REPORT_SIZE < REPORT_IDS + 2
+#define REPORT_BUFFER_SIZE  (REPORT_IDS + 2)
+#else
+#define REPORT_BUFFER_SIZE  REPORT_SIZE
+#endif
+
+#define REPORT_PACKED       (REPORT_AXIS_BITS % 8 || REPORT_BUTTON)
+
+static uchar    reportBuffer[REPORT_BUFFER_SIZE];   /* buffer for HID reports */
+#if KEYBOARD != 2
+static uchar    *reportPtr;         /* where reportPut() writes next */
+#if REPORT_PACKED
+static uchar    reportBit;          /* bits of *reportPtr already written */
+#endif
+#if REPORT_BUTTON
+static uchar    reportButton;       /* state of button 1 */
+#endif
+#endif
+#if KEYBOARD != 2
+static unsigned int reportQueue[REPORT_BATCH]; /* samples for the next report */
+#endif
+static uchar    reportQueued;
+static uchar    reportSequence;     /* counts interrupt reports */
+static unsigned int reportStamp;    /* timestamp of the newest queued sample */
+static uchar    idleRate;           /* in 4 ms units */
+static unsigned int reportLast;     /* value of the last queued sample */
+static unsigned int reportTime;     /* clockMillis when the last report was sent */
+
+#if POLL_LOCK
+#define POLL_TICKS(us)  ((unsigned int)((unsigned long)(us) * (F_CPU / 64) / 1000000UL))
+#define POLL_LEAD       POLL_TICKS(POLL_LEAD_US)
+#define POLL_UNKNOWN    0xffff
+static unsigned int pollLast;       /* clockTicks() when the host last took a report */
+static unsigned int pollPeriod;     /* host poll interval in clockTicks() */
+static uchar    pollCount;          /* intervals measured, up to 8 */
+static uchar    pollLocked;         /* pollLast is recent enough to predict from */
+static uchar    pollBusy;           /* a report was waiting at the last look */
+#endif
+
+#if KEYBOARD
+#define KEY_QUEUE       4
+static uchar    keyQueue[KEY_QUEUE];/* usage IDs of keys still to be typed */
+static uchar    keyQueued;
+static uchar    keyDown;            /* a press was sent, the release is due */
+static uchar    keyStep;            /* step of the last sample, see keyboardStep() */
+static uchar    keyTurn;            /* the joystick went last, see reportPoll() */
+#endif
+
+#if EVENTS
+static uchar    eventBuffer[8];     /* step event waiting for endpoint 3 */
+static uchar    eventLength;        /* of the event in eventBuffer, 0 if none */
+static uchar    eventStep;          /* step of the last step event */
+static unsigned int eventTime;      /* clockMillis of the last diagnostics event */
+#endif
+
+#define ADC_TEMP_SETTLE 2   /* conversions discarded after switching the reference */
+#define ADC_TEMP_SAMPLES 4  /* conversions averaged per temperature reading */
+#define ADC_RING_SIZE   8   /* conversions queued by adcQueue(), power of 2 */
+
+static uchar        adcPending;     /* input currently being converted */
+#if !ADC_TRIGGER
+static uchar        adcDiscard;     /* conversions left until the input settled */
+#endif
+#if TEMP_COMPENSATION
+static uchar        adcTempCount;   /* conversions in adcTempSum */
+static unsigned int adcTempSum;
+static unsigned int adcTempTime;    /* adcPoll() time of the last reading */
+#endif
+#if MOTION_REST_MS && !ADC_TRIGGER
+#define ADC_REST_WAKE   (POLL_LOCK && KEYBOARD != 2)
+static uchar        adcResting;     /* no conversion running until the rest is over */
+static unsigned int adcRestStart;   /* adcPoll() time, or clockTicks() with ADC_REST_WAKE */
+#if ADC_REST_WAKE
+#if MOTION_REST_MS > 250
+#error "MOTION_REST_MS must be at most 250 with POLL_LOCK"
+#endif
+#define ADC_REST_TICKS  POLL_TICKS(MOTION_REST_MS * 1000L)
+/* From the end of a rest to a completed sample: the restart, then each
+ * channel's settling and oversampled conversions. A conversion at clk/128
+ * takes 26 clockTicks().
+ */
+#define ADC_SAMPLE_TICKS (26 * (1 + ADC_CHANNELS * (ADC_SETTLE + ADC_OVERSAMPLE)))
+static unsigned int adcRestLength;  /* see pollWake() */
+#endif
+#endif
+#if ADC_TRIGGER
+static unsigned int adcRing[ADC_RING_SIZE]; /* conversions, channel in bit 15 */
+static volatile uchar adcRingHead;  /* written by adcQueue() */
+static uchar        adcRingTail;    /* written by adcPoll() */
+#endif
+static uchar        adcCount[2];    /* conversions accumulated in adcSum */
+static unsigned int adcSum[2];      /* oversampling accumulators */
+static unsigned int usbPending;     /* a new sample has been published */
+static unsigned int adcSample[2];   /* back buffer filled by the running ADC */
+static unsigned int adc_value[2];   /* last completed pair */
+unsigned int        adcResult;
+#if MOTION_REST_MS
+uchar               motionRest;
+static uchar        motionStill;    /* samples without motion, up to MOTION_STILL_SAMPLES */
+#endif
+static unsigned int adcTime;        /* clockStamp() when it was completed */
+/* ADC_TRIGGER interleaves the pair conversion by conversion, which spreads
+ * a spike over consecutive samples. The median then runs on each channel's
+ * conversions before they are summed.
+ */
+#define FILTER_SAMPLE_MEDIAN        (FILTER_MEDIAN && !ADC_TRIGGER)
+#define FILTER_CONVERSION_MEDIAN    (FILTER_MEDIAN && ADC_TRIGGER)
+
+#if FILTER_SAMPLE_MEDIAN
+static unsigned int filterHistory[2];   /* previous two samples */
+#endif
+#if FILTER_CONVERSION_MEDIAN
+static unsigned int adcHistory[2][2];   /* previous two conversions per channel */
+#define ADC_HISTORY_EMPTY   0xffff      /* no conversion yet, not a 10 bit value */
+#endif
+#if FILTER_EMA_SHIFT
+static unsigned int filterAverage;
+#endif
+#if FILTER_SAMPLE_MEDIAN || FILTER_EMA_SHIFT
+static uchar        filterPrimed;   /* the first sample has filled the state */
+#endif
+
+const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
+#if KEYBOARD != 2
+    REPORT_DESCRIPTOR_JOYSTICK     // see report.h
+#endif
+#if KEYBOARD
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06,                    // USAGE (Keyboard)
+    0xa1, 0x01,                    // COLLECTION (Application)
+#if REPORT_IDS
+    0x85, REPORT_ID_KEYBOARD,      //   REPORT_ID (3)
+#endif
+    0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
+    0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
+    0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x95, 0x08,                    //   REPORT_COUNT (8)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
+    0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)
+    0x25, 0x65,                    //   LOGICAL_MAXIMUM (101)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0xc0,                          // END_COLLECTION
+#endif
+#if DIAGNOSTICS
+    0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
+    0x09, 0x10,                    // USAGE (Vendor Usage 0x10: diagnostics)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_DIAGNOSTICS,   //   REPORT_ID (2)
+    0x27, 0xff, 0xff, 0xff, 0x7f,  //   LOGICAL_MAXIMUM (2147483647)
+    0x09, 0x11,                    //   USAGE (Vendor Usage 0x11: loops per second)
+    0x75, 0x20,                    //   REPORT_SIZE (32)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x09, 0x12,                    //   USAGE (Vendor Usage 0x12: watchdog resets)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x09, 0x13,                    //   USAGE (Vendor Usage 0x13: samples dropped)
+    0x75, 0x10,                    //   REPORT_SIZE (16)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x09, 0x14,                    //   USAGE (Vendor Usage 0x14: max loop cycles)
+    0x09, 0x15,                    //   USAGE (Vendor Usage 0x15: ADC conversions)
+    0x75, 0x20,                    //   REPORT_SIZE (32)
+    0x95, 0x02,                    //   REPORT_COUNT (2)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0xc0,                          // END_COLLECTION
+#endif
+};
+
+/* Fails to compile if report.h got a fragment length wrong */
+#if KEYBOARD != 2
+typedef char reportDescriptorCheck[sizeof((const char[]){ REPORT_DESCRIPTOR_JOYSTICK })
+                                   == REPORT_DESCRIPTOR_JOYSTICK_LENGTH ? 1 : -1];
+#endif
+
+#if EVENTS
+/* Interface 0 is the HID interface of the default descriptor in usbdrv.c.
+ * Endpoint 3 goes into a vendor class interface 1: the HID driver only ever
+ * reads the first interrupt endpoint of an interface, and as no driver binds
+ * to interface 1 it can be claimed without detaching the joystick.
+ */
+const PROGMEM char usbDescriptorConfiguration[USB_CFG_DESCR_PROPS_CONFIGURATION] = {
+    9,                             // sizeof(usbDescrConfig)
+    USBDESCR_CONFIG,
+    USB_CFG_DESCR_PROPS_CONFIGURATION, 0, // total length of data returned
+    2,                             // number of interfaces
+    1,                             // index of this configuration
+    0,                             // configuration name string index
+    (1 << 7),                      // attributes: bus powered
+    USB_CFG_MAX_BUS_POWER / 2,     // max USB current in 2mA units
+    9,                             // sizeof(usbDescrInterface)
+    USBDESCR_INTERFACE,
+    0,                             // index of this interface
+    0,                             // alternate setting
+    1,                             // endpoints excl 0
+    USB_CFG_INTERFACE_CLASS,
+    USB_CFG_INTERFACE_SUBCLASS,
+    USB_CFG_INTERFACE_PROTOCOL,
+    0,                             // string index for interface
+    9,                             // sizeof(usbDescrHID), must be at offset 18
+    USBDESCR_HID,
+    0x01, 0x01,                    // HID version 1.01
+    0x00,                          // target country code
+    0x01,                          // number of report descriptors
+    0x22,                          // descriptor type: report
+    USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+    7,                             // sizeof(usbDescrEndpoint)
+    USBDESCR_ENDPOINT,
+    (char)0x81,                    // IN endpoint 1
+    0x03,                          // interrupt
+    8, 0,                          // maximum packet size
+    USB_CFG_INTR_POLL_INTERVAL,
+    9,                             // sizeof(usbDescrInterface)
+    USBDESCR_INTERFACE,
+    1,                             // index of this interface
+    0,                             // alternate setting
+    1,                             // endpoints excl 0
+    0xff,                          // vendor specific class
+    0,                             // subclass
+    0,                             // protocol
+    0,                             // string index for interface
+    7,                             // sizeof(usbDescrEndpoint)
+    USBDESCR_ENDPOINT,
+    (char)(0x80 | USB_CFG_EP3_NUMBER), // IN endpoint 3
+    0x03,                          // interrupt
+    8, 0,                          // maximum packet size
+    USB_CFG_INTR_POLL_INTERVAL,
+};
+#endif
+
+/*
+ * Report Format:
+ *
+ * BYTE0	BYTE1
+ * YYYYYYYY	YYYYYYYY
+ * 76543210	fedcba98
+ * y - axis value 0-65535
+ *
+ * With REPORT_BATCH > 1:
+ *
+ * BYTE0	BYTE1	BYTE2..
+ * SSSSSSSS	CCCCCCCC	Y0 Y1 ..
+ * S - sequence number, incremented with every interrupt report
+ * C - number of new samples in this report, 1..REPORT_BATCH
+ * Yn - samples as above, oldest first. Unused slots repeat the newest
+ *      sample, so a plain joystick driver still sees the current position.
+ *
+ * With REPORT_TIMESTAMP, two more bytes follow with the time the newest
+ * sample was completed, see clockStamp().
+ *
+ * With REPORT_IDS, all of the above is preceded by REPORT_ID_JOYSTICK.
+ *
+ * Keyboard Format (KEYBOARD):
+ *
+ * BYTE0	BYTE1
+ * MMMMMMMM	KKKKKKKK
+ * M - modifier bits, left control to right GUI
+ * K - usage ID of the key pressed, 0 for none
+ *
+ * With REPORT_IDS, preceded by REPORT_ID_KEYBOARD.
+ */
+#if REPORT_CURVE
+/* The table is generated by the compiler from the curve formulas, so the
+ * firmware contains no floating point code.
+ */
+#if REPORT_CURVE == 1
+#define CURVE_POINT(i)  (65535L * (i) / 16)
+#elif REPORT_CURVE == 2
+#define CURVE_POINT(i)  (65535L * (48L * (i) * (i) - 2L * (i) * (i) * (i)) / 4096)
+#elif REPORT_CURVE == 3
+#if REPORT_DEADZONE < 1 || REPORT_DEADZONE > 7
+#error "REPORT_DEADZONE must be 1..7"
+#endif
+#define CURVE_LOW       (8 - REPORT_DEADZONE)
+#define CURVE_HIGH      (8 + REPORT_DEADZONE)
+#define CURVE_POINT(i)  ((i) < CURVE_LOW ? 32768L * (i) / CURVE_LOW :          \
+                         (i) > CURVE_HIGH ? 32768L + 32767L * ((i) - CURVE_HIGH) / CURVE_LOW : \
+                         32768L)
+#else
+#error "REPORT_CURVE must be 0..3"
+#endif
+
+static const PROGMEM unsigned int curveTable[17] = {
+    CURVE_POINT(0),  CURVE_POINT(1),  CURVE_POINT(2),  CURVE_POINT(3),
+    CURVE_POINT(4),  CURVE_POINT(5),  CURVE_POINT(6),  CURVE_POINT(7),
+    CURVE_POINT(8),  CURVE_POINT(9),  CURVE_POINT(10), CURVE_POINT(11),
+    CURVE_POINT(12), CURVE_POINT(13), CURVE_POINT(14), CURVE_POINT(15),
+    CURVE_POINT(16)
+};
+
+/* Interpolate between the two table points around value. All curves are
+ * monotonic, so the segment never slopes down.
+ */
+static unsigned int curveApply(unsigned int value)
+{
+    const unsigned int *point = &curveTable[value >> 12];
+    unsigned int y0 = pgm_read_word(point);
+    unsigned int y1 = pgm_read_word(point + 1);
+
+    return y0 + (((unsigned long)(y1 - y0) * (value & 0x0fff)) >> 12);
+}
+#endif
+
+#if KEYBOARD != 2
+#if REPORT_PACKED
+/* Append the low bits of value, LSB first as HID packs fields, see report.h */
+static void reportPut(unsigned int value, uchar bits)
+{
+    while(bits) {
+        uchar n = 8 - reportBit;
+
+        if(!reportBit)
+            *reportPtr = 0;
+        *reportPtr |= (uchar)(value << reportBit);
+        if(n > bits)
+            n = bits;
+        value >>= n;
+        bits -= n;
+        reportBit = (reportBit + n) & 7;
+        if(!reportBit)
+            reportPtr++;
+    }
+}
+#else
+/* All fields are whole bytes */
+static void reportPut(unsigned int value, uchar bits)
+{
+    *reportPtr++ = (uchar)(value & 0xFF);
+    if(bits > 8)
+        *reportPtr++ = (uchar)(value >> 8);
+}
+#endif
+
+/* Fill reportBuffer with the fields report.h lays out */
+static void buildReport(unsigned int *samples, uchar count, unsigned int time)
+{
+    uchar   i;
+
+    reportPtr = reportBuffer;
+#if REPORT_PACKED
+    reportBit = 0;
+#endif
+#if REPORT_IDS
+    reportPut(REPORT_ID_JOYSTICK, 8);
+#endif
+#if REPORT_SEQUENCE
+    reportPut(reportSequence, 8);
+#endif
+#if REPORT_BATCH > 1
+    reportPut(count, 8);
+#endif
+    for(i = 0; i < REPORT_BATCH; i++) {
+        unsigned int value = samples[i < count ? i : count - 1];
+#if REPORT_CURVE
+        value = curveApply(value);
+#endif
+        reportPut(value >> (16 - REPORT_AXIS_BITS), REPORT_AXIS_BITS);
+    }
+#if REPORT_AXES > 1
+    reportPut(adc_value[0] >> (16 - REPORT_AXIS_BITS), REPORT_AXIS_BITS);
+#endif
+#if REPORT_TIMESTAMP
+    reportPut(time, 16);
+#endif
+#if REPORT_BUTTON
+    if(samples[count - 1] >= 0x8000)
+        reportButton = 1;
+    else if(samples[count - 1] < 0x7000)
+        reportButton = 0;
+    reportPut(reportButton, 1);
+#endif
+}
+
+/* Queue a sample for the next interrupt report. If the host doesn't fetch
+ * reports fast enough, the oldest sample gives way.
+ */
+static void reportAdd(unsigned int value)
+{
+    uchar i;
+
+    if(reportQueued == REPORT_BATCH) {
+        for(i = 1; i < REPORT_BATCH; i++)
+            reportQueue[i - 1] = reportQueue[i];
+        reportQueued--;
+#if DIAGNOSTICS
+        diagnostics.samplesDropped++;
+#endif
+    }
+    reportQueue[reportQueued++] = value;
+    reportLast = value;
+    reportStamp = adcTime;
+}
+#endif
+
+#if KEYBOARD || EVENTS
+/* The step value is in when the travel is cut into equal steps, as reported */
+static uchar reportStep(unsigned int value, uchar steps)
+{
+#if REPORT_CURVE
+    value = curveApply(value);
+#endif
+    return ((unsigned long)value * steps) >> 16;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------- Keyboard functions -------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if KEYBOARD
+#if KEYBOARD_STEPS < 2 || KEYBOARD_STEPS > 255
+#error "KEYBOARD_STEPS must be 2..255"
+#endif
+
+#define KEY_MOD_SHIFT   0x02        /* left shift */
+#define KEY_SPACE       0x2c
+#define KEY_COMMA       0x36        /* '<' with shift */
+#define KEY_PERIOD      0x37        /* '>' with shift */
+
+static uchar keyboardReport(uchar key)
+{
+    uchar   *p = reportBuffer;
+
+#if REPORT_IDS
+    *p++ = REPORT_ID_KEYBOARD;
+#endif
+    *p++ = key && key != KEY_SPACE ? KEY_MOD_SHIFT : 0;
+    *p++ = key;
+    return p - reportBuffer;
+}
+
+/* Type a key for every step the reported value crosses, as pedal_controller
+ * does on the host. A jump over several steps types a single key. If the host
+ * falls KEY_QUEUE keys behind, further keys are lost.
+ */
+static void keyboardStep(unsigned int value)
+{
+    uchar   step = reportStep(value, KEYBOARD_STEPS), key;
+
+    if(step == keyStep)
+        return;
+    if(step == 0 || keyStep == 0)
+        key = KEY_SPACE;
+    else if(step > keyStep)
+        key = KEY_PERIOD;
+    else
+        key = KEY_COMMA;
+    keyStep = step;
+    if(keyQueued < KEY_QUEUE)
+        keyQueue[keyQueued++] = key;
+}
+
+/* Called when the interrupt endpoint is free. Every press is followed by a
+ * release in the next report, so that repeated keys are seen as such.
+ * Returns 1 if the endpoint was used.
+ */
+static uchar keyboardPoll(void)
+{
+    uchar   key = 0, i;
+
+    if(keyDown) {
+        keyDown = 0;
+    } else if(keyQueued) {
+        key = keyQueue[0];
+        for(i = 1; i < keyQueued; i++)
+            keyQueue[i - 1] = keyQueue[i];
+        keyQueued--;
+        keyDown = 1;
+    } else {
+        return 0;
+    }
+    usbSetInterrupt(reportBuffer, keyboardReport(key));
+    return 1;
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Event functions ---------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if EVENTS
+#if EVENT_STEPS < 2 || EVENT_STEPS > 255
+#error "EVENT_STEPS must be 2..255"
+#endif
+
+/* Build a step event if value is in another step than the last one. An event
+ * the host hasn't fetched yet is replaced, the step in it is absolute.
+ */
+static void eventStepCheck(unsigned int value)
+{
+    uchar   step = reportStep(value, EVENT_STEPS);
+
+    if(step == eventStep)
+        return;
+    eventStep = step;
+    eventBuffer[0] = EVENT_STEP;
+    eventBuffer[1] = step;
+    eventBuffer[2] = (uchar)(value & 0xFF);
+    eventBuffer[3] = (uchar)(value >> 8);
+    eventBuffer[4] = (uchar)(adcTime & 0xFF);
+    eventBuffer[5] = (uchar)(adcTime >> 8);
+    eventLength = 6;
+}
+
+/* Called from reportPoll(). Step events go first, the diagnostics event is
+ * sent when the endpoint has nothing else to do.
+ */
+static void eventPoll(unsigned int now)
+{
+    if(!usbInterruptIsReady3())
+        return;
+    if(eventLength) {
+        usbSetInterrupt3(eventBuffer, eventLength);
+        eventLength = 0;
+    }
+#if DIAGNOSTICS && EVENT_DIAGNOSTICS_MS
+    else if(now - eventTime >= EVENT_DIAGNOSTICS_MS) {
+        uchar   buffer[8];
+
+        buffer[0] = EVENT_DIAGNOSTICS;
+        buffer[1] = diagnostics.watchdogResets;
+        buffer[2] = (uchar)(diagnostics.samplesDropped & 0xFF);
+        buffer[3] = (uchar)(diagnostics.samplesDropped >> 8);
+        buffer[4] = (uchar)(diagnostics.loopsPerSecond & 0xFF);
+        buffer[5] = (uchar)(diagnostics.loopsPerSecond >> 8);
+        buffer[6] = (uchar)(diagnostics.loopsPerSecond >> 16);
+        buffer[7] = (uchar)(diagnostics.loopsPerSecond >> 24);
+        usbSetInterrupt3(buffer, sizeof(buffer));
+        eventTime = now;
+    }
+#endif
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------- Calibration functions ------------------------- */
+/* ------------------------------------------------------------------------- */
+
+static uchar calibrationSum(calibration_t *record)
+{
+    uchar   *p = (uchar *)record;
+    uchar   i = sizeof(calibration_t);
+    uchar   sum = 0;
+
+    do {
+        sum += *p++;
+    } while(--i);
+    return sum;
+}
+
+uchar calibrationValid(calibration_t *record)
+{
+    return record->version == CALIBRATION_VERSION
+           && calibrationSum(record) == 0xff
+           && record->travelMax > record->travelMin;
+}
+
+void calibrationApply(void)
+{
+    /* one division here saves one per sample */
+    travelScale = 0xffffffffUL / (calibration.travelMax - calibration.travelMin);
+}
+
+/* The identity calibration, used when EEPROM holds no valid record */
+void calibrationDefaults(void)
+{
+    calibration.version = CALIBRATION_VERSION;
+    calibration.offset[0] = 0;
+    calibration.offset[1] = 0;
+    calibration.gain[0] = 0x4000;
+    calibration.gain[1] = 0x4000;
+    calibration.travelMin = 0;
+    calibration.travelMax = 0xffff;
+    calibration.deadband = REPORT_DEADBAND;
+    calibration.drift = 0;
+    calibration.driftReference = 0;
+    calibration.checksum = 0;
+    calibration.checksum = 0xff - calibrationSum(&calibration);
+}
+
+static unsigned int calibrateChannel(uchar channel, unsigned int value)
+{
+    long            offset = (long)value + calibration.offset[channel];
+    unsigned long   scaled;
+
+    if(offset < 0)
+        offset = 0;
+    else if(offset > 0xffff)
+        offset = 0xffff;
+    scaled = ((unsigned long)offset * calibration.gain[channel]) >> 14;
+    return scaled > 0xffff ? 0xffff : scaled;
+}
+
+#if TEMP_COMPENSATION
+/* Take out the drift of the pot and the reference since the temperature was
+ * driftReference. The sensor reads about one LSB per degree.
+ */
+static unsigned int calibrateDrift(unsigned int value)
+{
+    long corrected;
+
+    if(!temperature)
+        return value;
+    corrected = (long)value - (((long)((int)temperature - (int)calibration.driftReference)
+                                * calibration.drift) >> 4);
+    if(corrected < 0)
+        return 0;
+    return corrected > 0xffff ? 0xffff : corrected;
+}
+#endif
+
+static unsigned int calibrateTravel(unsigned int value)
+{
+    if(value <= calibration.travelMin)
+        return 0;
+    if(value >= calibration.travelMax)
+        return 0xffff;
+    return ((value - calibration.travelMin) * travelScale) >> 16;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Filter functions --------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if FILTER_EMA_SHIFT > 6
+#error "FILTER_EMA_SHIFT must be 0..6"
+#endif
+
+#if FILTER_MEDIAN
+/* Median of value and the two before it in history, which moves on by one */
+static unsigned int filterMedian(unsigned int *history, unsigned int value)
+{
+    unsigned int lo = history[0];
+    unsigned int hi = history[1];
+
+    history[0] = hi;
+    history[1] = value;
+    if(lo > hi) {
+        unsigned int t = lo;
+        lo = hi;
+        hi = t;
+    }
+    if(value < lo)
+        return lo;
+    if(value > hi)
+        return hi;
+    return value;
+}
+#endif
+
+/* Despike with a median of three, then smooth with a shift-only exponential
+ * moving average. Samples are stretched to 16 bits, so there are at least
+ * 16 - ADC_BITS bits below the conversion LSB to absorb the truncation of the
+ * shift. The first sample after coreInit() fills the history and the
+ * average, so the output doesn't climb from 0 after every boot. Uses 7 bytes
+ * of RAM. Estimated from the C source, not measured: the median should cost
+ * about 40 cycles and the average about 25 + 4 * FILTER_EMA_SHIFT cycles,
+ * under 100 cycles (6 us) per sample in the default configuration.
+ */
+static unsigned int filterSample(unsigned int value)
+{
+#if FILTER_SAMPLE_MEDIAN || FILTER_EMA_SHIFT
+    if(!filterPrimed) {
+        filterPrimed = 1;
+#if FILTER_SAMPLE_MEDIAN
+        filterHistory[0] = value;
+        filterHistory[1] = value;
+#endif
+#if FILTER_EMA_SHIFT
+        filterAverage = value;
+#endif
+    }
+#endif
+#if FILTER_SAMPLE_MEDIAN
+    value = filterMedian(filterHistory, value);
+#endif
+#if FILTER_EMA_SHIFT
+    if(value > filterAverage)
+        filterAverage += (value - filterAverage) >> FILTER_EMA_SHIFT;
+    else
+        filterAverage -= (filterAverage - value) >> FILTER_EMA_SHIFT;
+    value = filterAverage;
+#endif
+    return value;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Motion functions --------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if MOTION_REST_MS
+#if MOTION_STILL_SAMPLES < 1 || MOTION_STILL_SAMPLES > 255
+#error "MOTION_STILL_SAMPLES must be 1..255"
+#endif
+
+/* Compare a new sample, before filtering, with the filtered value so far.
+ * Their difference is what the filter is about to move by, so motion is seen
+ * on the first sample instead of after the median's one sample of delay.
+ */
+static void motionUpdate(unsigned int sample)
+{
+    unsigned int delta = sample > adcResult ? sample - adcResult : adcResult - sample;
+
+    if(delta > MOTION_THRESHOLD) {
+        motionStill = 0;
+        motionRest = 0;
+    } else if(motionStill < MOTION_STILL_SAMPLES) {
+        motionStill++;
+    } else {
+        motionRest = 1;
+    }
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Poll functions ----------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if POLL_LOCK
+/* Called with every reportPoll(). The host polls at a fixed interval, so the
+ * moments it takes a report are a multiple of it apart. Each such interval,
+ * unless a report sat through more than four polls, refines pollPeriod:
+ * quickly at first, then averaging over eight.
+ */
+static void pollTrack(unsigned int ticks)
+{
+    uchar busy = !usbInterruptIsReady();
+
+    if(pollBusy && !busy) {         /* taken since the last look */
+        unsigned int interval = ticks - pollLast;
+
+        if(pollLocked) {
+            unsigned int polls = (interval + pollPeriod / 2) / pollPeriod;
+
+            if(polls && polls <= 4) {
+                int error = interval / polls - pollPeriod;
+
+                pollPeriod += error / (pollCount < 8 ? 2 : 8);
+                if(pollCount < 8)
+                    pollCount++;
+            }
+        }
+        pollLast = ticks;
+        pollLocked = 1;
+    } else if(pollLocked && ((ticks - pollLast) & 0x8000)) {
+        pollLocked = 0;             /* too long ago, 127 ms */
+    }
+    pollBusy = busy;
+}
+
+#if KEYBOARD != 2
+/* Ticks until the next expected poll, or POLL_UNKNOWN */
+static unsigned int pollUntil(unsigned int ticks)
+{
+    if(!pollLocked)
+        return POLL_UNKNOWN;
+    return pollPeriod - (ticks - pollLast) % pollPeriod;
+}
+
+#if ADC_REST_WAKE
+/* Length of a rest starting now, at most length ticks. It ends when a sample
+ * started then completes just as reportPoll() loads the endpoint, POLL_LEAD
+ * before a poll, so resting doesn't make the reported sample older. Without
+ * a known poll phase, or if no such moment falls within length, it is the
+ * full length.
+ */
+static unsigned int pollWake(unsigned int ticks, unsigned int length)
+{
+    unsigned int    until = pollUntil(ticks);
+    int             wake;
+
+    if(until == POLL_UNKNOWN)
+        return length;
+    wake = (int)(until - POLL_LEAD - ADC_SAMPLE_TICKS);
+    while(wake < 0)
+        wake += pollPeriod;
+    if((unsigned int)wake > length)
+        return length;
+    return wake + (length - wake) / pollPeriod * pollPeriod;
+}
+#endif
+#endif
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ----------------------------- ADC functions ----------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if ADC_DIFFERENTIAL && ADC_DIFF_BIPOLAR
+#define adcEncode(value)    (((value) ^ 0x200) & 0x3ff) /* two's complement to offset binary */
+#else
+#define adcEncode(value)    (value)
+#endif
+
+#if ADC_OVERSAMPLE == 1
+#define ADC_OVERSAMPLE_BITS 0
+#elif ADC_OVERSAMPLE == 4
+#define ADC_OVERSAMPLE_BITS 1
+#elif ADC_OVERSAMPLE == 16
+#define ADC_OVERSAMPLE_BITS 2
+#elif ADC_OVERSAMPLE == 64
+#define ADC_OVERSAMPLE_BITS 3
+#else
+#error "ADC_OVERSAMPLE must be 1, 4, 16 or 64"
+#endif
+#define ADC_BITS    (10 + ADC_OVERSAMPLE_BITS)
+
+/* Decimate an oversampled sum to ADC_BITS and stretch it to 16 bits. The top
+ * bits are repeated in the vacated low bits so that full scale maps to 65535.
+ */
+static unsigned int adcDecimate(unsigned int sum)
+{
+    unsigned int value = sum >> ADC_OVERSAMPLE_BITS;
+    return (value << (16 - ADC_BITS)) | (value >> (2 * ADC_BITS - 16));
+}
+
+/* Add one conversion of a channel to its oversampling accumulator. Once both
+ * channels (or the differential channel) have completed a sample, the set is
+ * published to adc_value, overwriting a pair the host hasn't fetched yet, so
+ * the report built when the interrupt endpoint frees up always holds the
+ * freshest pair instead of one sampled a whole poll interval earlier.
+ * Returns 1 if the channel's sample is complete.
+ */
+uchar adcCollect(uchar channel, unsigned int value)
+{
+#if DIAGNOSTICS
+    diagnostics.adcConversions++;
+#endif
+#if FILTER_CONVERSION_MEDIAN
+    unsigned int *history = adcHistory[channel];
+
+    value = adcEncode(value);
+    if(history[0] == ADC_HISTORY_EMPTY) {
+        history[0] = value;
+        history[1] = value;
+    }
+    adcSum[channel] += filterMedian(history, value);
+#else
+    adcSum[channel] += adcEncode(value);
+#endif
+    if(++adcCount[channel] < ADC_OVERSAMPLE)
+        return 0;
+    adcSample[channel] = calibrateChannel(channel, adcDecimate(adcSum[channel]));
+    adcSum[channel] = 0;
+    adcCount[channel] = 0;
+    if(channel == ADC_CHANNELS - 1) {
+        unsigned int sample;
+
+        adc_value[0] = adcSample[0];  // Publish the completed pair
+        adc_value[1] = adcSample[1];
+        // FIXME: Output just ADC2 for now
+        sample = adc_value[ADC_CHANNELS - 1];
+#if TEMP_COMPENSATION
+        sample = calibrateDrift(sample);
+#endif
+        sample = calibrateTravel(sample);
+#if MOTION_REST_MS
+        motionUpdate(sample);
+#endif
+        adcResult = filterSample(sample);
+        adcTime = clockStamp();
+#if DIAGNOSTICS
+        if(usbPending)                // The previous one was never looked at
+            diagnostics.samplesDropped++;
+#endif
+        usbPending = 1;               // Flag for a USB report
+    }
+    return 1;
+}
+
+#if CAPTURE
+/* Run a burst capture requested by RQ_CAPTURE_START. The platform lets the
+ * ADC free run and adcBurstRead() waits for every conversion, so nothing but
+ * the USB interrupt runs until the buffer is full: CAPTURE_SAMPLES
+ * conversions take 101 us each. A USB interrupt longer than one conversion
+ * loses a sample, which shows up in capture.ticks. Afterwards the pending
+ * input settles anew, for ADC_TEMP_SETTLE conversions if it is the
+ * temperature sensor.
+ */
+static void adcCapture(void)
+{
+    uchar           i;
+    unsigned int    start = 0;
+
+    capture.input = captureRequest & 0x7f;
+    captureRequest = 0;
+    adcBurstStart(capture.input);
+    for(i = 0; i < ADC_SETTLE + CAPTURE_SAMPLES; i++) {
+        unsigned int value = adcBurstRead();
+
+        if(i < ADC_SETTLE)
+            continue;
+        if(i == ADC_SETTLE)
+            start = clockTicks();
+        capture.samples[i - ADC_SETTLE] = value;
+    }
+    capture.ticks = clockTicks() - start;
+    capture.count = CAPTURE_SAMPLES;
+    adcBurstStop();
+    adcSelect(adcPending);
+#if !ADC_TRIGGER
+    adcDiscard = adcPending == ADC_TEMPERATURE ? ADC_TEMP_SETTLE : ADC_SETTLE;
+#endif
+}
+#endif
+
+#if ADC_TRIGGER
+/* Called by the ADC interrupt with every conversion, which the platform
+ * triggers at ADC_SAMPLE_RATE. Only queue the result and select the other
+ * channel for the next trigger, which leaves the rest of the period for the
+ * input to settle.
+ */
+void adcQueue(unsigned int value)
+{
+    uchar head = adcRingHead;
+    uchar next = (head + 1) & (ADC_RING_SIZE - 1);
+
+    if(next != adcRingTail) {        // Drop the conversion if the ring is full
+        adcRing[head] = value | ((unsigned int)adcPending << 15);
+        adcRingHead = next;
+    }
+    if(ADC_CHANNELS > 1) {
+        adcPending ^= 1;             // Interleave the pair
+        adcSelect(adcPending);
+    }
+}
+
+/* Called from the main loop with clockNow() */
+void adcPoll(unsigned int now)
+{
+#if CAPTURE
+    if(captureRequest) {
+        adcCapture();
+        return;
+    }
+#endif
+    while(adcRingTail != adcRingHead) {
+        unsigned int value = adcRing[adcRingTail];
+        adcRingTail = (adcRingTail + 1) & (ADC_RING_SIZE - 1);
+        adcCollect(value >> 15, value & 0x3ff);
+    }
+}
+#else
+/* Called from the main loop with clockNow(). The ADC never waits for the USB
+ * side: a new conversion is started as soon as the previous one finishes.
+ * Each channel is converted ADC_OVERSAMPLE times in a row and the sum
+ * decimated into one sample, so the input only switches once per sample. In
+ * differential mode it never switches at all.
+ *
+ * After a switch the sample and hold capacitor needs time to follow the new
+ * input. Instead of busy waiting, the first ADC_SETTLE conversions on the new
+ * input are thrown away, so adcPoll() always returns immediately.
+ *
+ * While the pedal rests (motionRest), the ADC idles for MOTION_REST_MS after
+ * each complete sample. With POLL_LOCK the rest ends early, when the next
+ * sample would complete right before a poll, see pollWake().
+ *
+ * The temperature sensor is read first, and then every TEMP_INTERVAL_MS
+ * between two samples.
+ * It needs the internal 1.1 V reference, which takes ADC_TEMP_SETTLE
+ * conversions to settle both ways.
+ */
+void adcPoll(unsigned int now)
+{
+#if CAPTURE
+    if(captureRequest) {
+        adcCapture();
+        return;
+    }
+#endif
+    if(adcBusy())                    // Conversion still running
+        return;
+#if MOTION_REST_MS
+    if(adcResting) {
+#if ADC_REST_WAKE
+        if(clockTicks() - adcRestStart < adcRestLength)
+#else
+        if(now - adcRestStart < MOTION_REST_MS)
+#endif
+            return;
+        adcResting = 0;
+        adcStart();                  // Rest is over, the last result is stale
+        return;
+    }
+#endif
+    if(adcDiscard) {                 // Input still settling, drop this result
+        adcDiscard--;
+#if TEMP_COMPENSATION
+    } else if(adcPending == ADC_TEMPERATURE) {
+        adcTempSum += adcRead();
+        if(++adcTempCount == ADC_TEMP_SAMPLES) {
+            temperature = adcTempSum / ADC_TEMP_SAMPLES;
+            adcTempSum = 0;
+            adcTempCount = 0;
+            adcPending = 0;          // Back to the pedal
+            adcSelect(0);
+            adcDiscard = ADC_TEMP_SETTLE;
+        }
+#endif
+    } else if(adcCollect(adcPending, adcRead())) {
+#if MOTION_REST_MS || TEMP_COMPENSATION
+        uchar sampled = adcPending == ADC_CHANNELS - 1;
+#endif
+
+#if MOTION_REST_MS
+        if(motionRest && sampled) {
+            adcResting = 1;
+#if ADC_REST_WAKE
+            adcRestStart = clockTicks();
+            adcRestLength = pollWake(adcRestStart, ADC_REST_TICKS);
+#else
+            adcRestStart = now;
+#endif
+        }
+#endif
+        if(ADC_CHANNELS > 1) {
+            adcPending ^= 1;         // Read next channel
+            adcSelect(adcPending);
+            adcDiscard = ADC_SETTLE;
+        }
+#if TEMP_COMPENSATION
+        if(sampled && now - adcTempTime >= TEMP_INTERVAL_MS) {
+            adcTempTime = now;
+            adcPending = ADC_TEMPERATURE;
+            adcSelect(ADC_TEMPERATURE);
+            adcDiscard = ADC_TEMP_SETTLE;
+        }
+#endif
+    }
+#if MOTION_REST_MS
+    if(adcResting)
+        return;
+#endif
+    adcStart();                      // Start next conversion
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Report functions --------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Called from the main loop with clockNow(). Queue a new sample once it moved
+ * past the deadband. Without movement, repeat the last value every idleRate *
+ * 4 ms as HID idle semantics demand; an idle rate of 0 disables the heartbeat.
+ * With KEYBOARD 1, keys and samples take turns on the endpoint, so typing a
+ * run of keys doesn't hold the joystick back. A keyboard only build has no
+ * heartbeat, its keys are never held down longer than one report. Events go
+ * to endpoint 3 independently. With POLL_LOCK, samples are only loaded into
+ * the endpoint shortly before the host is expected to poll.
+ */
+void reportPoll(unsigned int now)
+{
+#if POLL_LOCK
+    unsigned int ticks = clockTicks();
+
+    pollTrack(ticks);
+#endif
+    if(usbPending) {
+        unsigned int delta = adcResult > reportLast ?
+            adcResult - reportLast : reportLast - adcResult;
+
+        if(delta > calibration.deadband) {
+#if KEYBOARD
+            keyboardStep(adcResult);
+#endif
+#if EVENTS
+            eventStepCheck(adcResult);
+#endif
+#if KEYBOARD == 2
+            reportLast = adcResult;
+#else
+            reportAdd(adcResult);
+#endif
+        }
+        usbPending = 0;
+    }
+#if EVENTS
+    eventPoll(now);
+#endif
+    if(usbInterruptIsReady()) {
+#if KEYBOARD == 1
+        if((keyTurn || !reportQueued) && keyboardPoll()) {
+            keyTurn = 0;
+            return;
+        }
+#elif KEYBOARD
+        if(keyboardPoll())
+            return;
+#endif
+#if KEYBOARD != 2
+        if(!reportQueued && idleRate
+           && now - reportTime >= (unsigned int)idleRate * 4)
+            reportAdd(adcResult);
+#if POLL_LOCK
+        if(reportQueued) {
+            unsigned int until = pollUntil(ticks);
+
+            if(until != POLL_UNKNOWN && until > POLL_LEAD
+               && (REPORT_BATCH == 1 || reportQueued < REPORT_BATCH))
+                return;             /* a fresher sample may come in time */
+        }
+#endif
+        if(reportQueued) {
+            buildReport(reportQueue, reportQueued, reportStamp);
+            usbSetInterrupt(reportBuffer, REPORT_SIZE);
+            reportSequence++;
+            reportQueued = 0;
+            reportTime = now;
+#if KEYBOARD == 1
+            keyTurn = 1;            /* keys go first next time */
+#endif
+        }
+#endif
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------ interface to USB driver ------------------------ */
+/* ------------------------------------------------------------------------- */
+
+/* The setup packet as V-USB receives it. usbRequest_t is not used, as its
+ * usbWord_t fields are wider than 16 bits in the host build.
+ */
+typedef struct setupPacket {
+    uchar   bmRequestType;
+    uchar   bRequest;
+    uchar   wValue[2];
+    uchar   wIndex[2];
+    uchar   wLength[2];
+} setupPacket_t;
+
+uchar usbFunctionSetup(uchar data[8])
+{
+    setupPacket_t   *rq = (void *)data;
+
+    usbMsgPtr = reportBuffer;
+    if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS)
+    {    /* class request type */
+        if(rq->bRequest == USBRQ_HID_GET_REPORT)
+        {  /* wValue: ReportType (highbyte), ReportID (lowbyte) */
+#if DIAGNOSTICS
+            if(rq->wValue[0] == REPORT_ID_DIAGNOSTICS) {
+                diagnostics.loopCyclesMax = (unsigned long)loopTicksMax * 64;
+                loopTicksMax = 0;
+                usbMsgPtr = (uchar *)&diagnostics;
+                return sizeof(diagnostics_t);
+            }
+#endif
+#if KEYBOARD == 2
+            return keyboardReport(0);
+#else
+#if KEYBOARD
+            if(rq->wValue[0] == REPORT_ID_KEYBOARD)
+                return keyboardReport(0);   /* keys are only down for one report */
+#endif
+            /* usbFunctionSetup() is called from usbPoll() in the main loop,
+             * the same context that publishes adcResult, so the 16 bit value
+             * can't be torn by a sample completing halfway through.
+             */
+            buildReport(&adcResult, 1, adcTime);
+            return REPORT_SIZE;
+#endif
+        }
+        else if(rq->bRequest == USBRQ_HID_GET_IDLE)
+        {
+            usbMsgPtr = &idleRate;
+            return 1;
+        }
+        else if(rq->bRequest == USBRQ_HID_SET_IDLE)
+        {
+            idleRate = rq->wValue[1];
+        }
+    }
+    else if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR)
+    {
+        if(rq->bRequest == RQ_GET_CALIBRATION)
+        {
+            usbMsgPtr = (uchar *)&calibration;
+            return sizeof(calibration_t);
+        }
+        else if(rq->bRequest == RQ_SET_CALIBRATION)
+        {
+            /* A record of the wrong length is marked as already complete,
+             * so usbFunctionWrite() stalls its first packet. Without data
+             * stage the status stage stays unanswered and the host sees
+             * the request fail.
+             */
+            if(rq->wLength[0] != sizeof(calibration_t) || rq->wLength[1])
+                calibrationReceived = sizeof(calibration_t);
+            else
+                calibrationReceived = 0;
+            return USB_NO_MSG;      /* receive the record in usbFunctionWrite() */
+        }
+#if TEMP_COMPENSATION
+        else if(rq->bRequest == RQ_GET_TEMPERATURE)
+        {
+            usbMsgPtr = (uchar *)&temperature;
+            return sizeof(temperature);
+        }
+#endif
+#if CAPTURE
+        else if(rq->bRequest == RQ_CAPTURE_START)
+        {
+            /* V-USB can't stall a request without data stage. Returning
+             * USB_NO_MSG leaves its status stage unanswered, so the host
+             * sees the request fail for an input that isn't converted.
+             */
+            if(rq->wValue[0] >= ADC_CHANNELS || rq->wValue[1])
+                return USB_NO_MSG;
+            captureRequest = 0x80 | rq->wValue[0];    /* run by the main loop */
+        }
+        else if(rq->bRequest == RQ_CAPTURE_READ)
+        {
+            /* The capture runs in the main loop right after the usbPoll()
+             * that started it, so it is complete by the time this arrives.
+             */
+            usbMsgPtr = (uchar *)&capture;
+            return sizeof(capture_t);
+        }
+#endif
+    }
+    return 0;
+}
+
+/* Collect a new calibration record. It replaces the one in use, and is queued
+ * for saving to EEPROM, only if it passes calibrationValid(). Otherwise the
+ * request is stalled.
+ */
+uchar usbFunctionWrite(uchar *data, uchar len)
+{
+    uchar *p = (uchar *)&calibrationNew + calibrationReceived;
+
+    if(len > sizeof(calibration_t) - calibrationReceived)
+        return 0xff;                /* more data than announced */
+    calibrationReceived += len;
+    while(len--)
+        *p++ = *data++;
+    if(calibrationReceived < sizeof(calibration_t))
+        return 0;
+    if(!calibrationValid(&calibrationNew))
+        return 0xff;
+    calibration = calibrationNew;
+    calibrationApply();
+    calibrationUnsaved = sizeof(calibration_t);
+    return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void coreInit(void)
+{
+    calibrationReceived = 0;
+    calibrationUnsaved = 0;
+    usbPending = 0;
+    idleRate = REPORT_IDLE_RATE;
+    reportQueued = 0;
+    reportSequence = 0;
+    reportStamp = 0;
+    reportLast = 0;
+    reportTime = 0;
+#if KEYBOARD
+    keyQueued = 0;
+    keyDown = 0;
+    keyTurn = 0;
+    keyStep = KEYBOARD_STEPS / 2;   /* pedal_controller starts in the middle */
+#endif
+#if POLL_LOCK
+    pollLast = 0;
+    pollPeriod = POLL_TICKS(USB_CFG_INTR_POLL_INTERVAL * 1000L);
+    pollCount = 0;
+    pollLocked = 0;
+    pollBusy = 0;
+#endif
+#if EVENTS
+    eventLength = 0;
+    eventStep = 0xff;               /* no step yet, the first sample sends one */
+    eventTime = 0;
+#endif
+#if TEMP_COMPENSATION
+    adcPending = ADC_TEMPERATURE;   /* so the first sample is already corrected */
+    adcDiscard = ADC_TEMP_SETTLE;
+    adcTempCount = 0;
+    adcTempSum = 0;
+    adcTempTime = 0;
+#else
+    adcPending = 0;
+#if !ADC_TRIGGER
+    adcDiscard = 0;
+#endif
+#endif
+    adcSelect(adcPending);
+#if MOTION_REST_MS && !ADC_TRIGGER
+    adcResting = 0;
+#endif
+#if ADC_TRIGGER
+    adcRingHead = 0;
+    adcRingTail = 0;
+#endif
+    adcCount[0] = 0;
+    adcCount[1] = 0;
+    adcSum[0] = 0;
+    adcSum[1] = 0;
+    adcSample[0] = 0;
+    adcSample[1] = 0;
+    adc_value[0] = 0;
+    adc_value[1] = 0;
+    adcResult = 0;
+    adcTime = 0;
+#if MOTION_REST_MS
+    motionRest = 0;
+    motionStill = 0;
+#endif
+#if FILTER_SAMPLE_MEDIAN
+    filterHistory[0] = 0;
+    filterHistory[1] = 0;
+#endif
+#if FILTER_CONVERSION_MEDIAN
+    adcHistory[0][0] = ADC_HISTORY_EMPTY;
+    adcHistory[1][0] = ADC_HISTORY_EMPTY;
+#endif
+#if FILTER_EMA_SHIFT
+    filterAverage = 0;
+#endif
+#if FILTER_SAMPLE_MEDIAN || FILTER_EMA_SHIFT
+    filterPrimed = 0;
+#endif
+#if TEMP_COMPENSATION
+    temperature = 0;
+#endif
+#if CAPTURE
+    capture.count = 0;
+    captureRequest = 0;
+#endif
+#if DIAGNOSTICS
+    diagnostics.reportId = REPORT_ID_DIAGNOSTICS;
+    diagnostics.loopsPerSecond = 0;
+    diagnostics.samplesDropped = 0;
+    diagnostics.loopCyclesMax = 0;
+    diagnostics.adcConversions = 0;
+    loopTicksMax = 0;
+#endif
+}
@@ -0,0 +1,145 @@
+/* Name: core.h
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Signal path and USB request handling of the diffjoy firmware. core.c does
+ * no register access, so it also builds natively for the benchmark in bench/.
+ * The platform, main.c on the AVR, calls adcPoll() and reportPoll() from its
+ * main loop and provides the clock and the ADC access functions below, which
+ * adcPoll() sequences the conversions with.
+ */
+#ifndef __core_h_included__
+#define __core_h_included__
+
+#include "config.h"
+#include "usbdrv.h"
+
+#define CALIBRATION_VERSION 2
+
+/* Vendor requests */
+#define RQ_GET_CALIBRATION  1   /* IN, returns calibration_t */
+#define RQ_SET_CALIBRATION  2   /* OUT, sizeof(calibration_t) bytes */
+#define RQ_CAPTURE_START    3   /* OUT, no data, wValue: input 0 (PB3) or 1 (PB4), fails otherwise */
+#define RQ_CAPTURE_READ     4   /* IN, returns capture_t */
+#define RQ_GET_TEMPERATURE  5   /* IN, returns the last sensor reading, 16 bit */
+
+#if ADC_DIFFERENTIAL
+#define ADC_CHANNELS    1
+#else
+#define ADC_CHANNELS    2
+#endif
+#define ADC_SETTLE      1   /* conversions discarded after switching the input */
+#define ADC_TEMPERATURE 2   /* adcSelect() input of the temperature sensor */
+
+/* Per unit calibration, stored in EEPROM and applied on every sample. All
+ * values are in 16 bit sample units unless noted, little endian. The record is only
+ * accepted if version matches and all its bytes sum up to 0xff.
+ */
+typedef struct calibration {
+    uchar           version;        /* CALIBRATION_VERSION */
+    int             offset[2];      /* added to each channel */
+    unsigned int    gain[2];        /* each channel is scaled by gain / 0x4000 */
+    unsigned int    travelMin;      /* reported as 0 */
+    unsigned int    travelMax;      /* reported as 65535 */
+    unsigned int    deadband;       /* see REPORT_DEADBAND */
+    int             drift;          /* sample change per temperature LSB, in 1/16 */
+    unsigned int    driftReference; /* temperature reading without drift */
+    uchar           checksum;
+} calibration_t;
+
+extern calibration_t    calibration;
+extern uchar            calibrationUnsaved; /* bytes left to write to EEPROM */
+
+#define REPORT_ID_JOYSTICK      1   /* only sent with REPORT_IDS */
+#define REPORT_ID_DIAGNOSTICS   2
+#define REPORT_ID_KEYBOARD      3
+
+#if KEYBOARD < 0 || KEYBOARD > 2
+#error "KEYBOARD must be 0..2"
+#endif
+
+#if DIAGNOSTICS
+
+/* Feature report REPORT_ID_DIAGNOSTICS, little endian. It is sent in two 8
+ * byte packets, each copied in one go by usbPoll(), so the fields are laid
+ * out not to straddle the packet boundary and are never torn.
+ */
+typedef struct diagnostics {
+    uchar           reportId;       /* REPORT_ID_DIAGNOSTICS */
+    unsigned long   loopsPerSecond; /* main loop iterations in the last second */
+    uchar           watchdogResets; /* since power on */
+    unsigned int    samplesDropped; /* replaced before they could be reported */
+    unsigned long   loopCyclesMax;  /* longest iteration since the last read */
+    unsigned long   adcConversions; /* completed, excluding settling ones */
+} diagnostics_t;
+
+extern diagnostics_t    diagnostics;
+extern unsigned int     loopTicksMax;   /* longest iteration in clockTicks() */
+#endif
+
+#if EVENTS
+/* Events on interrupt endpoint 3, little endian. The first byte is the type.
+ *
+ * EVENT_STEP: step (0..EVENT_STEPS-1), value (16 bit, as reported), time
+ *     (16 bit, clockStamp() of the sample). The first event after a reset
+ *     gives the step the value starts in.
+ * EVENT_DIAGNOSTICS: watchdogResets (8 bit), samplesDropped (16 bit),
+ *     loopsPerSecond (32 bit), as in diagnostics_t.
+ */
+#define EVENT_STEP          1
+#define EVENT_DIAGNOSTICS   2
+#endif
+
+#if CAPTURE
+/* The last burst capture, little endian. count is 0 until the first capture
+ * completed. Differential builds always capture the differential input.
+ */
+typedef struct capture {
+    unsigned int    ticks;          /* Timer1 ticks from the first to the last sample */
+    uchar           input;          /* as requested by RQ_CAPTURE_START */
+    uchar           count;          /* CAPTURE_SAMPLES */
+    unsigned int    samples[CAPTURE_SAMPLES];  /* raw conversions */
+} capture_t;
+
+extern capture_t        capture;
+extern uchar            captureRequest; /* 0x80 | input, cleared by the platform */
+#endif
+
+extern unsigned int     adcResult;      /* last completed sample, as reported */
+#if MOTION_REST_MS
+extern uchar            motionRest;     /* the pedal rests, see MOTION_REST_MS */
+#endif
+
+/* provided by the platform */
+extern unsigned int clockStamp(void);
+#if POLL_LOCK || CAPTURE
+extern unsigned int clockTicks(void);   /* Timer1 ticks of 64 cycles */
+#endif
+/* Inputs are 0 (PB3), 1 (PB4) or ADC_TEMPERATURE; differential builds only
+ * use input 0, which then measures PB4 - PB3.
+ */
+extern void adcSelect(uchar input);     /* takes effect with the next conversion */
+#if !ADC_TRIGGER
+extern void adcStart(void);
+extern uchar adcBusy(void);             /* a conversion started by adcStart() is running */
+extern unsigned int adcRead(void);      /* result of the last conversion */
+#endif
+#if CAPTURE
+extern void adcBurstStart(uchar input); /* convert back to back, see adcCapture() */
+extern unsigned int adcBurstRead(void); /* waits for the next conversion */
+extern void adcBurstStop(void);
+#endif
+
+extern void coreInit(void);
+extern uchar calibrationValid(calibration_t *record);
+extern void calibrationDefaults(void);
+extern void calibrationApply(void);
+extern uchar adcCollect(uchar channel, unsigned int value);
+#if ADC_TRIGGER
+extern void adcQueue(unsigned int value);   /* called by the ADC interrupt */
+#endif
+extern void adcPoll(unsigned int now);
+extern void reportPoll(unsigned int now);
+
+#endif /* __core_h_included__ */
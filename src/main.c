@@ -15,8 +15,10 @@
 #include <util/delay.h>
 #include <stdlib.h>
 
+#include "config.h"
 #include "usbdrv.h"
 #include "oddebug.h"
+#include "core.h"
 
 /*
    Pin assignment:
@@ -32,115 +34,364 @@
 #define ADC_0 3
 #define ADC_1 2
 
+/*
+   EEPROM layout:
+   0  = OSCCAL value, see main() and usbEventResetReady()
+   1  = ~OSCCAL if location 0 was measured by usbEventResetReady()
+   16 = calibration record, see calibration_t
+   */
+
+#define EEPROM_CALIBRATION  ((void *)16)
+
 #define UTIL_BIN4(x)        (uchar)((0##x & 01000)/64 + (0##x & 0100)/16 + (0##x & 010)/4 + (0##x & 1))
 #define UTIL_BIN8(hi, lo)   (uchar)(UTIL_BIN4(hi) * 16 + UTIL_BIN4(lo))
 
-static uchar    reportBuffer[2];    /* buffer for HID reports */
-static uchar    idleRate;           /* in 4 ms units */
-
-static unsigned int adcPrevious;
-static unsigned int adcPending;
-static unsigned int usbPending;
-static unsigned int adc_value[2];
-
-const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
-    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
-    0x15, 0x00,                    // LOGICAL_MINIMUM (0)
-    0x09, 0x04,                    // USAGE (Joystick)
-    0xa1, 0x01,                    // COLLECTION (Application)
-    0x05, 0x01,                    //   USAGE_PAGE (Generic Desktop)
-    0x09, 0x01,                    //   USAGE (Pointer)
-    0xa1, 0x00,                    //   COLLECTION (Physical)
-    0x09, 0x30,                    //     USAGE (X)
-    0x27, 0xff, 0xff, 0x00, 0x00,  //     LOGICAL_MAXIMUM (65535)
-    0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-    0x75, 0x10,                    //     REPORT_SIZE (16)
-    0x95, 0x01,                    //     REPORT_COUNT (1)
-    0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-    0xc0,                          //   END_COLLECTION
-    0xc0                           // END_COLLECTION
-};
+#if DIAGNOSTICS
+static unsigned long    loopCount;      /* iterations in the current second */
+static unsigned int     loopSecond;     /* clockNow() when it started */
+static unsigned int     loopStart;      /* clockTicks() of this iteration */
+/* not cleared by the C startup code, so it survives watchdog resets */
+static uchar            watchdogResets __attribute__((section(".noinit")));
+#endif
 
-/*
- * Report Format:
- *
- * BYTE0	BYTE1
- * YYYYYYYY	-----BYY
- * 76543210	-----098
- * y - axis value 0-1023
- * B - button 0-1
+static volatile unsigned int clockMillis;   /* Timer1 overflows, ~1 ms each */
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Timer functions ---------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Timer1 free runs at clk/64 and overflows every 16384 cycles, 0.993 ms at
+ * 16.5 MHz. The overflow interrupt extends it to a 16 bit millisecond clock.
+ */
+static void clockInit(void)
+{
+    TCCR1 = UTIL_BIN4(0111);        /* normal mode, clk/64 */
+    TIMSK |= (1 << TOIE1);
+}
+
+ISR(TIMER1_OVF_vect, ISR_NOBLOCK)
+{
+    clockMillis++;
+}
+
+static unsigned int clockNow(void)
+{
+    unsigned int now;
+
+    do {                            /* reread if the interrupt hit in between */
+        now = clockMillis;
+    } while(now != clockMillis);
+    return now;
+}
+
+#if REPORT_TIMESTAMP == 1 || DIAGNOSTICS || CAPTURE || POLL_LOCK
+/* Timer1 ticks of 64 cycles (3.9 us), wrapping after 254 ms. Retry while an
+ * overflow is pending, as TCNT1 has then wrapped but clockMillis not yet.
+ */
+unsigned int clockTicks(void)
+{
+    unsigned int    millis;
+    uchar           ticks;
+
+    do {
+        millis = clockMillis;
+        ticks = TCNT1;
+    } while(millis != clockMillis || (TIFR & (1 << TOV1)));
+    return (millis << 8) | ticks;
+}
+#endif
+
+/* The time adcCollect() stamps samples with, see REPORT_TIMESTAMP */
+unsigned int clockStamp(void)
+{
+#if REPORT_TIMESTAMP == 1
+    return clockTicks();
+#else
+    return clockNow();
+#endif
+}
+
+#if DIAGNOSTICS
+/* Called once per main loop iteration. Loop times are kept in Timer1 ticks
+ * and only scaled to cycles when read, see usbFunctionSetup(). An iteration
+ * that runs longer than 254 ms wraps, but the watchdog fires at 1 s anyway.
+ * The second is counted as 1007 Timer1 overflows, 16.5 MHz / 16384.
+ */
+static void diagnosticsLoop(void)
+{
+    unsigned int ticks = clockTicks();
+    unsigned int now = clockNow();
+
+    if(ticks - loopStart > loopTicksMax)
+        loopTicksMax = ticks - loopStart;
+    loopStart = ticks;
+    loopCount++;
+    if(now - loopSecond >= 1007) {
+        diagnostics.loopsPerSecond = loopCount;
+        loopCount = 0;
+        loopSecond += 1007;
+    }
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------- Calibration functions ------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* Load the record from EEPROM, or the identity calibration if it is erased,
+ * corrupt or from another firmware version.
+ */
+static void calibrationInit(void)
+{
+    eeprom_read_block(&calibration, EEPROM_CALIBRATION, sizeof(calibration_t));
+    if(!calibrationValid(&calibration))
+        calibrationDefaults();
+    calibrationApply();
+}
+
+/* Save a new record one byte per call, so that the 3.4 ms EEPROM write time
+ * never blocks the main loop.
  */
-static void buildReport(unsigned int value)
+static void calibrationPoll(void)
 {
-    reportBuffer[0] = (uchar)(value & 0xFF);
-    reportBuffer[1] = (uchar)(value >> 8);
+    if(calibrationUnsaved && eeprom_is_ready()) {
+        uchar i = sizeof(calibration_t) - calibrationUnsaved--;
+        eeprom_update_byte((uchar *)EEPROM_CALIBRATION + i, ((uchar *)&calibration)[i]);
+    }
 }
 
 /* ------------------------------------------------------------------------- */
 /* ----------------------------- ADC functions ----------------------------- */
 /* ------------------------------------------------------------------------- */
 
+#if ADC_DIFFERENTIAL
+#if ADC_DIFF_GAIN == 20
+#define ADC_DIFF    UTIL_BIN4(0111)     /* ADC2 - ADC3, gain 20x */
+#elif ADC_DIFF_GAIN == 1
+#define ADC_DIFF    UTIL_BIN4(0110)     /* ADC2 - ADC3, gain 1x */
+#else
+#error "ADC_DIFF_GAIN must be 1 or 20"
+#endif
+#define ADC_FIRST   ADC_DIFF
+#else
+#define ADC_FIRST   ADC_0
+#endif
+
+#if TEMP_COMPENSATION && ADC_TRIGGER
+#error "TEMP_COMPENSATION needs conversions started by the main loop, ADC_TRIGGER 0"
+#endif
+
+#if ADC_TRIGGER
+/* Timer0 runs in CTC mode with the smallest prescaler which reaches the
+ * requested period. Compare match A triggers the conversions.
+ */
+#define ADC_TIMER_PERIOD    ((F_CPU + ADC_SAMPLE_RATE / 2) / ADC_SAMPLE_RATE)
+#if ADC_TIMER_PERIOD <= 256L * 8
+#define ADC_TIMER_DIV       8
+#define ADC_TIMER_CS        UTIL_BIN4(0010)
+#elif ADC_TIMER_PERIOD <= 256L * 64
+#define ADC_TIMER_DIV       64
+#define ADC_TIMER_CS        UTIL_BIN4(0011)
+#elif ADC_TIMER_PERIOD <= 256L * 256
+#define ADC_TIMER_DIV       256
+#define ADC_TIMER_CS        UTIL_BIN4(0100)
+#elif ADC_TIMER_PERIOD <= 256L * 1024
+#define ADC_TIMER_DIV       1024
+#define ADC_TIMER_CS        UTIL_BIN4(0101)
+#else
+#error "ADC_SAMPLE_RATE too low for Timer0"
+#endif
+#if ADC_SAMPLE_RATE * USB_CFG_INTR_POLL_INTERVAL < 1000L * ADC_OVERSAMPLE * ADC_CHANNELS
+#error "ADC_SAMPLE_RATE too low to complete a sample every USB_CFG_INTR_POLL_INTERVAL"
+#endif
+#endif
+
+/* The ADC clock stays at clk/128, 129 kHz: above 200 kHz the ADC loses
+ * resolution, and the bits oversampling adds would only be noise. A sample,
+ * including the settling conversions, must complete within one interrupt
+ * poll interval. When triggered by the timer, a conversion must take at most
+ * half the trigger period to leave the other half for the mux to settle. A
+ * conversion takes 13 ADC clocks.
+ */
+#if ADC_TRIGGER
+#define ADC_CONVERSIONS     2
+#define ADC_CYCLES_MAX      ADC_TIMER_PERIOD
+#else
+#define ADC_CONVERSIONS     (ADC_CHANNELS * (ADC_OVERSAMPLE + ADC_SETTLE))
+#define ADC_CYCLES_MAX      (F_CPU / 1000L * USB_CFG_INTR_POLL_INTERVAL)
+#endif
+#define ADC_CYCLES(div)     (ADC_CONVERSIONS * 13L * (div))
+#define ADC_PRESCALE        UTIL_BIN4(0111) /* rate = 1/128 */
+#if ADC_CYCLES(128) > ADC_CYCLES_MAX
+#if ADC_TRIGGER
+#error "ADC_SAMPLE_RATE too high for the ADC at clk/128"
+#else
+#error "ADC_OVERSAMPLE too high to keep up with USB_CFG_INTR_POLL_INTERVAL at clk/128"
+#endif
+#endif
+
+/* The first input has been selected by coreInit() */
 static void adcInit(void)
 {
-    ADMUX = ADC_0;                  /* Vref=Vcc, measure ADC3 */
-    ADCSRA = UTIL_BIN8(1000, 0111); /* enable ADC, not free running, interrupt disable, rate = 1/128 */
+#if ADC_DIFFERENTIAL
+    ADCSRB = (ADC_DIFF_BIPOLAR << BIN); /* PB4 - PB3, rising with the pedal like the single ended build */
+#endif
+#if ADC_TRIGGER
+    ADCSRB |= UTIL_BIN4(0011);      /* trigger source Timer0 compare match A */
+    ADCSRA = UTIL_BIN8(1010, 1000) | ADC_PRESCALE; /* enable ADC, auto trigger, interrupt enable */
+    OCR0A = (ADC_TIMER_PERIOD + ADC_TIMER_DIV / 2) / ADC_TIMER_DIV - 1;
+    TCCR0A = (1 << WGM01);          /* CTC mode, count up to OCR0A */
+    TCCR0B = ADC_TIMER_CS;
+#else
+    ADCSRA = UTIL_BIN8(1000, 0000) | ADC_PRESCALE; /* enable ADC, not free running, interrupt disable */
+    ADCSRA |= (1 << ADSC);          /* start the first conversion of the pipeline */
+#endif
 }
 
-void adcPoll(void)
+/* Register access for adcPoll() in core.c, see core.h */
+void adcSelect(uchar input)
 {
-    // If conversion is finished and we have values to collect
-    if(!(ADCSRA & (1 << ADSC)) && (adcPending < 2)) {
-        adc_value[adcPending] = ADC; // Read ADC value into buffer
-        if(adcPending == 0){         // Read next channel
-            ADMUX = ADC_1;           // Switch to channel 1
-            _delay_ms(1);            // FIXME: Delay for ADC_1 read
-            ADCSRA |= (1 << ADSC);   // Start conversion
-        } else {
-            usbPending = 1;          // Both values read, flag for a USB report
-        }
-        adcPending++;                // Flag next ADC or all ADCs Read
-    }
-    if(adcPending >= 2) {
-        if(!usbPending) {            // Wait for last USB report to send
-            ADMUX = ADC_0;           // Switch to channel 0
-            ADCSRA |= (1 << ADSC);
-            adcPending = 0;          // Flag waiting for ADC_0
-        }
+#if TEMP_COMPENSATION
+    if(input == ADC_TEMPERATURE) {
+        ADMUX = UTIL_BIN8(1000, 1111);  /* Vref=1.1 V, measure ADC4 */
+        return;
     }
+#endif
+#if ADC_DIFFERENTIAL
+    ADMUX = ADC_DIFF;               /* Vref=Vcc, measure ADC2 - ADC3 */
+#else
+    ADMUX = input ? ADC_1 : ADC_0;  /* Vref=Vcc, measure ADC2 or ADC3 */
+#endif
+}
+
+#if ADC_TRIGGER
+/* Conversions are started by Timer0, so their spacing doesn't depend on the
+ * main loop. adcQueue() only queues the result and selects the next input.
+ * It must not delay the USB interrupt, hence ISR_NOBLOCK.
+ */
+ISR(ADC_vect, ISR_NOBLOCK)
+{
+    adcQueue(ADC);
+    TIFR = 1 << OCF0A;               // Rearm the trigger for the next match
+}
+#else
+void adcStart(void)
+{
+    ADCSRA |= (1 << ADSC);
+}
+
+uchar adcBusy(void)
+{
+    return ADCSRA & (1 << ADSC);
+}
+
+unsigned int adcRead(void)
+{
+    return ADC;
+}
+#endif
+
+#if CAPTURE
+static uchar adcBurstSRA, adcBurstSRB;  /* restored by adcBurstStop() */
+
+/* The ADC free runs with its interrupt off, so that no conversion waits for
+ * the main loop. Afterwards it is put back as adcInit() left it.
+ */
+void adcBurstStart(uchar input)
+{
+    adcBurstSRA = ADCSRA;
+    adcBurstSRB = ADCSRB;
+    ADCSRA = adcBurstSRA & ~((1 << ADATE) | (1 << ADIE));
+    while(ADCSRA & (1 << ADSC))      // Let a running conversion finish
+        ;
+    adcSelect(input);
+    ADCSRB = adcBurstSRB & ~UTIL_BIN4(0111); // Free running
+    ADCSRA = UTIL_BIN8(1111, 0111);  // enable, start, auto trigger, clear flag, rate = 1/128
+}
+
+unsigned int adcBurstRead(void)
+{
+    while(!(ADCSRA & (1 << ADIF)))
+        ;
+    ADCSRA |= (1 << ADIF);
+    return ADC;
 }
 
+void adcBurstStop(void)
+{
+    ADCSRA = UTIL_BIN8(1000, 0111);  // Stop free running after this conversion
+    while(ADCSRA & (1 << ADSC))
+        ;
+    ADCSRB = adcBurstSRB;
+#if ADC_TRIGGER
+    TIFR = 1 << OCF0A;               // Rearm the Timer0 trigger
+#endif
+    /* Drop the last capture conversion, adcPoll() starts the next one */
+    ADCSRA = (adcBurstSRA & ~(1 << ADSC)) | (1 << ADIF);
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 /* ------------------------ interface to USB driver ------------------------ */
 /* ------------------------------------------------------------------------- */
 
-uchar usbFunctionSetup(uchar data[8])
+/* Calibrate the RC oscillator to 8.25 MHz. The core clock of 16.5 MHz is
+ * derived from the 66 MHz peripheral clock by dividing. Our timing reference
+ * is the Start Of Frame signal (a single SE0 bit) available immediately after
+ * a USB RESET. We first do a binary search for the OSCCAL value and then
+ * optimize this value with a neighborhood search.
+ */
+static void calibrateOscillator(void)
 {
-    usbRequest_t    *rq = (void *)data;
+    uchar       step = 128;
+    uchar       trialValue = 0, optimumValue;
+    int         x, optimumDev, targetValue = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
 
-    usbMsgPtr = reportBuffer;
-    if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS)
-    {    /* class request type */
-        if(rq->bRequest == USBRQ_HID_GET_REPORT)
-        {  /* wValue: ReportType (highbyte), ReportID (lowbyte) */
-            /* we only have one report type, so don't look at wValue */
-            buildReport(0);
-            return sizeof(reportBuffer);
-        }
-        else if(rq->bRequest == USBRQ_HID_GET_IDLE)
-        {
-            usbMsgPtr = &idleRate;
-            return 1;
-        }
-        else if(rq->bRequest == USBRQ_HID_SET_IDLE)
-        {
-            idleRate = rq->wValue.bytes[1];
+    /* do a binary search: */
+    do {
+        OSCCAL = trialValue + step;
+        x = usbMeasureFrameLength();    /* proportional to current real frequency */
+        if(x < targetValue)             /* frequency still too low */
+            trialValue += step;
+        step >>= 1;
+    } while(step > 0);
+    /* We have a precision of +/- 1 for optimum OSCCAL here */
+    /* now do a neighborhood search for optimum value */
+    optimumValue = trialValue;
+    optimumDev = x; /* this is certainly far away from optimum */
+    for(OSCCAL = trialValue - 1; OSCCAL <= trialValue + 1; OSCCAL++) {
+        x = usbMeasureFrameLength() - targetValue;
+        if(x < 0)
+            x = -x;
+        if(x < optimumDev) {
+            optimumDev = x;
+            optimumValue = OSCCAL;
         }
     }
-    else
-    {
-        /* no vendor specific requests implemented */
+    OSCCAL = optimumValue;
+}
+/*
+Note: This calibration algorithm may try OSCCAL values of up to 192 even if
+the optimum value is far below 192. It may therefore exceed the allowed clock
+frequency of the CPU in low voltage designs!
+*/
+
+/* Recalibrate on every bus reset, so that units which enumerated on the crude
+ * OSCCAL offset in main() tune themselves. The result is only written to
+ * EEPROM when it changed, to spare the EEPROM and the 3.4 ms write.
+ */
+void usbEventResetReady(void)
+{
+    uchar value;
+
+    cli();  /* usbMeasureFrameLength() counts CPU cycles, keep all interrupts off */
+    calibrateOscillator();
+    sei();
+    value = OSCCAL;
+    if(eeprom_read_byte(0) != value || eeprom_read_byte((uchar *)1) != (uchar)~value) {
+        eeprom_write_byte(0, value);
+        eeprom_write_byte((uchar *)1, ~value);
     }
-    return 0;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -149,23 +400,37 @@ uchar usbFunctionSetup(uchar data[8])
 
 int main(void)
 {
-    usbPending = 0;
-    adcPending = 0;
-    adcPrevious = 0;
-    adc_value[0] = 0;
-    adc_value[1] = 0;
+    uchar resetFlags = MCUSR;
+    uchar warmBoot = (resetFlags & (1 << WDRF)) != 0;
+
+    MCUSR = 0;          /* after a watchdog reset, WDE stays set until WDRF is cleared */
+    wdt_disable();      /* ... at a 16 ms timeout, shorter than the disconnect below */
+    coreInit();
+    clockMillis = 0;
+#if DIAGNOSTICS
+    if(resetFlags & ((1 << PORF) | (1 << BORF)))
+        watchdogResets = 0;         /* RAM contents are undefined */
+    else if(resetFlags & (1 << WDRF))
+        watchdogResets++;
+    diagnostics.watchdogResets = watchdogResets;
+    loopCount = 0;
+    loopSecond = 0;
+#endif
 
     /* Calibrate the RC oscillator to 8.25 MHz. The core clock of 16.5 MHz is
      * derived from the 66 MHz peripheral clock by dividing. We assume that the
      * EEPROM contains a calibration value in location 0. If no calibration value
      * has been stored during programming, we offset Atmel's 8 MHz calibration
      * value according to the clock vs OSCCAL diagram in the data sheet. This
-     * seems to be sufficiently precise (<= 1%).
+     * seems to be sufficiently precise (<= 1%). A value measured against the
+     * host by usbEventResetReady() is marked by its complement in location 1.
      */
     uchar calibrationValue = eeprom_read_byte(0);
     if(calibrationValue != 0xff)
     {
         OSCCAL = calibrationValue;  /* a calibration value is supplied */
+        if(eeprom_read_byte((uchar *)1) == (uchar)~calibrationValue)
+            warmBoot = 1;           /* and known to work with USB */
     }
     else
     {
@@ -186,35 +451,41 @@ int main(void)
     odDebugInit();
     DDRB = (1 << USB_CFG_DMINUS_BIT) | (1 << USB_CFG_DPLUS_BIT);
     PORTB = 0;          /* indicate USB disconnect to host */
-    int i;
-    for(i=0;i<20;i++)
-    {  /* 300 ms disconnect, also allows our oscillator to stabilize */
-        _delay_ms(15);
+    /* The disconnect also allows our oscillator to stabilize, which is only
+     * needed on a cold start with an unproven calibration. Otherwise the host
+     * just has to notice the disconnect, which hubs latch as a port change.
+     */
+    int i = warmBoot ? BOOT_WARM_DISCONNECT_MS / 5 : BOOT_DISCONNECT_MS / 5;
+    while(i--)
+    {
+        _delay_ms(5);
     }
     DDRB = 1 << BIT_LED;    /* output for LED */
     DIDR0 |= (1 << ADC2D) | (1 << ADC3D); // Disable digital buffers on ADC inputs
     wdt_enable(WDTO_1S);
+    calibrationInit();
+    clockInit();
     adcInit();
     usbInit();
     sei();
+#if DIAGNOSTICS
+    loopStart = clockTicks();
+#endif
 
     while(1) {    /* main event loop */
         wdt_reset();
+#if DIAGNOSTICS
+        diagnosticsLoop();
+#endif
         usbPoll();
-        /* if a new value is ready and the last value was sent */
-        if(usbPending && usbInterruptIsReady()) {
-            buildReport(adc_value[1]);    // FIXME: Output just ADC2 for now
-            usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
-            usbPending = 0;
-        }
-        /* if the last measurement has been handed to the USB driver */
-        if(!usbPending) {
-            adcPoll();
-            if(adc_value[1] == 0) {       // FIXME: Check if ADC2 is locked to 0
-                PORTB |= 1 << BIT_LED;    /* turn on LED */
-            } else {
-                PORTB &= ~(1 << BIT_LED); /* turn off LED */
-            }
+        unsigned int now = clockNow();
+        reportPoll(now);
+        adcPoll(now);
+        calibrationPoll();
+        if(adcResult == 0) {              // FIXME: Check if ADC2 is locked to 0
+            PORTB |= 1 << BIT_LED;        /* turn on LED */
+        } else {
+            PORTB &= ~(1 << BIT_LED);     /* turn off LED */
         }
     }
     return 0;
@@ -0,0 +1,177 @@
+/* Name: report.h
+ * Project: DiffJoy
+ * Tabsize: 4
+ * License: GNU GPL v2 (see License.txt)
+ *
+ * Layout of the joystick input report, derived from the Report Layout options
+ * in config.h. Each field has its bits in the report, its part of the HID
+ * report descriptor and that part's length side by side, so the descriptor in
+ * core.c, its length in usbconfig.h and buildReport() can't disagree. Fields
+ * appear in this order, LSB first as HID packs them:
+ *
+ *   report ID          8 bits, only with REPORT_IDS
+ *   sequence           8 bits, with REPORT_SEQUENCE
+ *   count              8 bits, samples in this report, with REPORT_BATCH > 1
+ *   X                  REPORT_AXIS_BITS each, REPORT_BATCH times
+ *   Y                  REPORT_AXIS_BITS, with REPORT_AXES 2
+ *   timestamp          16 bits, with REPORT_TIMESTAMP
+ *   button             1 bit, with REPORT_BUTTON
+ *   padding            to the next byte
+ *
+ * Included from usbconfig.h, so only preprocessor definitions go here; the
+ * descriptor length is needed in #if by usbdrv.h.
+ */
+#ifndef __report_h_included__
+#define __report_h_included__
+
+#include "config.h"
+
+#define REPORT_AXIS_MAX         ((1L << REPORT_AXIS_BITS) - 1)
+
+/* ---------------------------- sequence, count ---------------------------- */
+
+#define REPORT_HEADER_FIELDS    (!!REPORT_SEQUENCE + (REPORT_BATCH > 1))
+#define REPORT_HEADER_BITS      (8 * REPORT_HEADER_FIELDS)
+
+#if REPORT_SEQUENCE
+#define REPORT_DESCRIPTOR_SEQUENCE \
+    0x09, 0x01,                    /*   USAGE (Vendor Usage 1: sequence) */
+#else
+#define REPORT_DESCRIPTOR_SEQUENCE
+#endif
+#if REPORT_BATCH > 1
+#define REPORT_DESCRIPTOR_COUNT \
+    0x09, 0x02,                    /*   USAGE (Vendor Usage 2: count) */
+#else
+#define REPORT_DESCRIPTOR_COUNT
+#endif
+#if REPORT_HEADER_FIELDS
+#define REPORT_DESCRIPTOR_HEADER \
+    0x06, 0x00, 0xff,              /*   USAGE_PAGE (Vendor Defined Page 1) */ \
+    REPORT_DESCRIPTOR_SEQUENCE \
+    REPORT_DESCRIPTOR_COUNT \
+    0x26, 0xff, 0x00,              /*   LOGICAL_MAXIMUM (255) */ \
+    0x75, 0x08,                    /*   REPORT_SIZE (8) */ \
+    0x95, REPORT_HEADER_FIELDS,    /*   REPORT_COUNT */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */
+#define REPORT_DESCRIPTOR_HEADER_LENGTH (12 + 2 * REPORT_HEADER_FIELDS)
+#else
+#define REPORT_DESCRIPTOR_HEADER
+#define REPORT_DESCRIPTOR_HEADER_LENGTH 0
+#endif
+
+/* --------------------------------- axes ---------------------------------- */
+
+#define REPORT_AXES_BITS        (REPORT_AXIS_BITS * (REPORT_BATCH + REPORT_AXES - 1))
+
+#if REPORT_AXES > 1
+#define REPORT_DESCRIPTOR_Y \
+    0x09, 0x31,                    /*     USAGE (Y) */ \
+    0x95, 0x01,                    /*     REPORT_COUNT (1) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */
+#else
+#define REPORT_DESCRIPTOR_Y
+#endif
+#define REPORT_DESCRIPTOR_AXES \
+    0x05, 0x01,                    /*   USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x01,                    /*   USAGE (Pointer) */ \
+    0xa1, 0x00,                    /*   COLLECTION (Physical) */ \
+    0x09, 0x30,                    /*     USAGE (X) */ \
+    0x27, REPORT_AXIS_MAX & 0xff, REPORT_AXIS_MAX >> 8, 0x00, 0x00, /* LOGICAL_MAXIMUM */ \
+    0x15, 0x00,                    /*     LOGICAL_MINIMUM (0) */ \
+    0x75, REPORT_AXIS_BITS,        /*     REPORT_SIZE */ \
+    0x95, REPORT_BATCH,            /*     REPORT_COUNT (REPORT_BATCH) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */ \
+    REPORT_DESCRIPTOR_Y \
+    0xc0,                          /*   END_COLLECTION */
+#define REPORT_DESCRIPTOR_AXES_LENGTH (22 + 6 * (REPORT_AXES > 1))
+
+/* ------------------------------- timestamp ------------------------------- */
+
+#define REPORT_TIMESTAMP_BITS   (16 * !!REPORT_TIMESTAMP)
+
+#if REPORT_TIMESTAMP
+#define REPORT_DESCRIPTOR_TIMESTAMP \
+    0x06, 0x00, 0xff,              /*   USAGE_PAGE (Vendor Defined Page 1) */ \
+    0x09, 0x02 + REPORT_TIMESTAMP, /*   USAGE (Vendor Usage 3: ticks, 4: ms) */ \
+    0x27, 0xff, 0xff, 0x00, 0x00,  /*   LOGICAL_MAXIMUM (65535) */ \
+    0x75, 0x10,                    /*   REPORT_SIZE (16) */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */
+#define REPORT_DESCRIPTOR_TIMESTAMP_LENGTH 16
+#else
+#define REPORT_DESCRIPTOR_TIMESTAMP
+#define REPORT_DESCRIPTOR_TIMESTAMP_LENGTH 0
+#endif
+
+/* -------------------------------- button --------------------------------- */
+
+#define REPORT_BUTTON_BITS      (!!REPORT_BUTTON)
+
+#if REPORT_BUTTON
+#define REPORT_DESCRIPTOR_BUTTON \
+    0x05, 0x09,                    /*   USAGE_PAGE (Button) */ \
+    0x09, 0x01,                    /*   USAGE (Button 1) */ \
+    0x25, 0x01,                    /*   LOGICAL_MAXIMUM (1) */ \
+    0x75, 0x01,                    /*   REPORT_SIZE (1) */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */
+#define REPORT_DESCRIPTOR_BUTTON_LENGTH 12
+#else
+#define REPORT_DESCRIPTOR_BUTTON
+#define REPORT_DESCRIPTOR_BUTTON_LENGTH 0
+#endif
+
+/* -------------------------------- padding -------------------------------- */
+
+#define REPORT_DATA_BITS        (REPORT_HEADER_BITS + REPORT_AXES_BITS \
+                                 + REPORT_TIMESTAMP_BITS + REPORT_BUTTON_BITS)
+#define REPORT_PADDING_BITS     ((8 - REPORT_DATA_BITS % 8) % 8)
+
+#if REPORT_PADDING_BITS
+#define REPORT_DESCRIPTOR_PADDING \
+    0x75, REPORT_PADDING_BITS,     /*   REPORT_SIZE */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x03,                    /*   INPUT (Cnst,Var,Abs) */
+#define REPORT_DESCRIPTOR_PADDING_LENGTH 6
+#else
+#define REPORT_DESCRIPTOR_PADDING
+#define REPORT_DESCRIPTOR_PADDING_LENGTH 0
+#endif
+
+/* -------------------------------- report --------------------------------- */
+
+/* Joystick report in bytes, including the report ID */
+#define REPORT_SIZE             (REPORT_IDS + (REPORT_DATA_BITS + REPORT_PADDING_BITS) / 8)
+
+/* Bit offset of the newest X sample: unused batch slots repeat it, so it is
+ * always in the last one. For the benches, which read it back.
+ */
+#define REPORT_NEWEST_BIT       (8 * REPORT_IDS + REPORT_HEADER_BITS \
+                                 + REPORT_AXIS_BITS * (REPORT_BATCH - 1))
+
+#if REPORT_IDS
+#define REPORT_DESCRIPTOR_ID \
+    0x85, REPORT_ID_JOYSTICK,      /*   REPORT_ID (1) */
+#else
+#define REPORT_DESCRIPTOR_ID
+#endif
+
+#define REPORT_DESCRIPTOR_JOYSTICK \
+    0x05, 0x01,                    /* USAGE_PAGE (Generic Desktop) */ \
+    0x15, 0x00,                    /* LOGICAL_MINIMUM (0) */ \
+    0x09, 0x04,                    /* USAGE (Joystick) */ \
+    0xa1, 0x01,                    /* COLLECTION (Application) */ \
+    REPORT_DESCRIPTOR_ID \
+    REPORT_DESCRIPTOR_HEADER \
+    REPORT_DESCRIPTOR_AXES \
+    REPORT_DESCRIPTOR_TIMESTAMP \
+    REPORT_DESCRIPTOR_BUTTON \
+    REPORT_DESCRIPTOR_PADDING \
+    0xc0,                          /* END_COLLECTION */
+#define REPORT_DESCRIPTOR_JOYSTICK_LENGTH (9 + 2 * REPORT_IDS \
+    + REPORT_DESCRIPTOR_HEADER_LENGTH + REPORT_DESCRIPTOR_AXES_LENGTH \
+    + REPORT_DESCRIPTOR_TIMESTAMP_LENGTH + REPORT_DESCRIPTOR_BUTTON_LENGTH \
+    + REPORT_DESCRIPTOR_PADDING_LENGTH)
+
+#endif /* __report_h_included__ */
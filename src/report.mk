@@ -0,0 +1,15 @@
+# Name: report.mk
+# Project: DiffJoy
+# Tabsize: 4
+# License: GPLv2.
+#
+# The report layout options of config.h as make variables, so that a layout
+# can be tried without spelling out DEFINES. Included by the firmware, bench
+# and sim Makefiles; variables given on the command line reach sub-makes too.
+# Example:
+# make REPORT_AXIS_BITS=10 REPORT_BATCH=3 REPORT_BUTTON=1
+
+REPORT_OPTIONS = REPORT_BATCH REPORT_TIMESTAMP REPORT_SEQUENCE REPORT_AXES \
+	REPORT_AXIS_BITS REPORT_BUTTON
+
+REPORT_DEFINES = $(foreach option,$(REPORT_OPTIONS),$(if $($(option)),-D$(option)=$($(option))))
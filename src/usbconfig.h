@@ -54,10 +54,11 @@
 /* Define this to 1 if you want to compile a version with two endpoints: The
  * default control endpoint 0 and an interrupt-in endpoint 1.
  */
-#define USB_CFG_HAVE_INTRIN_ENDPOINT3   0
+#define USB_CFG_HAVE_INTRIN_ENDPOINT3   EVENTS
 /* Define this to 1 if you want to compile a version with three endpoints: The
  * default control endpoint 0, an interrupt-in endpoint 1 and an interrupt-in
- * endpoint 3. You must also enable endpoint 1 above.
+ * endpoint 3. You must also enable endpoint 1 above. Endpoint 3 carries the
+ * event stream, see EVENTS in config.h.
  */
 #define USB_CFG_IMPLEMENT_HALT          0
 /* Define this to 1 if you also want to implement the ENDPOINT_HALT feature
@@ -79,7 +80,7 @@
  * The value is in milliamperes. [It will be divided by two since USB
  * communicates power requirements in units of 2 mA.]
  */
-#define USB_CFG_IMPLEMENT_FN_WRITE      0
+#define USB_CFG_IMPLEMENT_FN_WRITE      1
 /* Set this to 1 if you want usbFunctionWrite() to be called for control-out
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
@@ -100,6 +101,18 @@
  * of the macros usbDisableAllRequests() and usbEnableAllRequests() in
  * usbdrv.h.
  */
+#ifndef __ASSEMBLER__
+extern void usbEventResetReady(void);
+#endif
+#define USB_RESET_HOOK(isReset)         if(!isReset){usbEventResetReady();}
+/* This macro is a hook if you need to know when an USB RESET occurs. It has
+ * one parameter which distinguishes between the start of RESET state and its
+ * end. We use it to calibrate the RC oscillator after every bus reset.
+ */
+#define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   1
+/* define this macro to 1 if you want the function usbMeasureFrameLength()
+ * compiled in. This function can be used to calibrate the AVR's RC oscillator.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -157,13 +170,16 @@
 /* See USB specification if you want to conform to an existing device class or
  * protocol.
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH     31 /* total length of report descriptor */
+#include "config.h"
+#include "report.h"
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    ((KEYBOARD != 2) * REPORT_DESCRIPTOR_JOYSTICK_LENGTH + !!KEYBOARD * (35 + 2 * REPORT_IDS) + 45 * !!DIAGNOSTICS) /* total length of report descriptor */
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * Since this template defines a HID device, it must also specify a HID
  * report descriptor length. You must add a PROGMEM character array named
  * "usbHidReportDescriptor" to your code which contains the report descriptor.
- * Don't forget to keep the array and this define in sync!
+ * Don't forget to keep the array and this define in sync! The joystick part
+ * comes from report.h, the keyboard and diagnostics parts are fixed.
  */
 
 /* #define USB_PUBLIC static */
@@ -216,7 +232,10 @@
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
-#define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           (50 * !!EVENTS)
+/* With EVENTS, endpoint 3 gets an interface of its own, so core.c provides
+ * the configuration descriptor.
+ */
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0